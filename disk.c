@@ -3,7 +3,7 @@ Do not modify this file.
 Make all of your changes to main.c instead.
 */
 
-#define _XOPEN_SOURCE 500L
+#define _GNU_SOURCE
 
 #include "disk.h"
 
@@ -13,52 +13,474 @@ Make all of your changes to main.c instead.
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 extern ssize_t pread (int __fd, void *__buf, size_t __nbytes, __off_t __offset);
 extern ssize_t pwrite (int __fd, const void *__buf, size_t __nbytes, __off_t __offset);
 
+enum disk_op { DISK_OP_READ, DISK_OP_WRITE, DISK_OP_DISCARD };
+
+#define DISK_LABEL_MAGIC 0x53545250
+
+/* kept right after the data in every member of a striped disk, so that the
+   members are only ever put back together in the layout they were written in */
+struct disk_label {
+	uint32_t magic;
+	uint32_t id;       /* the same in all members of one disk */
+	int32_t member;    /* position in the list of files */
+	int32_t nmembers;
+	int64_t stripe;
+	int64_t size;
+};
+
+/* a request waiting in the simulated device's queue */
+struct disk_request {
+	int op;
+	off_t offset;
+	long length;
+	int64_t issued;  /* device clock when it was queued */
+};
+
+/* moves the shares of requests that fall on one member, in the order queued */
+struct disk_worker {
+	pthread_t thread;
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;   /* a share was queued, or the disk is closing */
+	pthread_cond_t done;   /* a share was finished */
+	struct disk_part *head, *tail;
+	int stop;
+};
+
 //typedef struct disk disk;
 struct disk {
 	int fd;
 	int block_size;
 	int nblocks;
+	off_t size;
+	int nmembers;   /* image files the blocks are striped across */
+	int *fds;       /* one per member, fds[0]==fd */
+	off_t stripe;   /* bytes placed on one member before moving to the next */
+	struct disk_worker *workers; /* one per member when there are several */
+
+	/* request accounting, shared by every thread using the disk */
+	pthread_mutex_t lock;
+	struct disk_stats stats;
+	int modelled;
+	struct disk_model model;
+	struct disk_request queue[DISK_QUEUE_MAX];
+	int nqueued;
+	off_t head;     /* where the last request served ended */
+};
+
+/* one member's share of a request: every stripe unit of the byte range
+   [start, end) of the disk that lies on that member */
+struct disk_part {
+	struct disk *d;
+	off_t start, end;
+	off_t base;            /* disk offset of data[0] */
+	unsigned char *data;
+	int write;
+	int error;
+	int done;
+	struct disk_part *next; /* in its member's worker queue */
 };
 
+static void *disk_part_io( void *arg );
+static void *disk_worker_run( void *arg );
+
 struct disk * disk_open( const char *diskname, int nblocks )
+{
+	return disk_open_striped(diskname,nblocks,DISK_STRIPE_BLOCKS);
+}
+
+/*
+Read the label at the end of member "i". Returns 1 if it is there and fits
+the layout "d" is opened with, 0 if the member is new and empty, and -1 if
+the member belongs to a different layout or to none.
+*/
+
+static int disk_label_check( struct disk *d, int i, uint32_t *id )
+{
+	struct disk_label label;
+	struct stat info;
+
+	if(fstat(d->fds[i],&info)<0) return -1;
+	if(d->nmembers==1) {
+		/* a flat image, unless it is one member of a striped disk */
+		if(info.st_size%BLOCK_SIZE!=sizeof(label)) return 1;
+		if(pread(d->fds[i],&label,sizeof(label),info.st_size-sizeof(label))!=sizeof(label)) return 1;
+		return label.magic==DISK_LABEL_MAGIC ? -1 : 1;
+	}
+	if(info.st_size==0) return 0;
+	if(info.st_size<(off_t)sizeof(label)) return -1;
+	if(pread(d->fds[i],&label,sizeof(label),info.st_size-sizeof(label))!=sizeof(label)) return -1;
+	if(label.magic!=DISK_LABEL_MAGIC || label.member!=i || label.nmembers!=d->nmembers
+	   || label.stripe!=d->stripe || label.size!=d->size) return -1;
+	if(i>0 && label.id!=*id) return -1;
+	*id = label.id;
+	return 1;
+}
+
+struct disk * disk_open_striped( const char *disknames, int nblocks, int stripe_blocks )
 {
 	struct disk *d;
+	char *names, *name, *rest;
+	int i, nfresh = 0, mismatch = 0;
+	uint32_t id = 0;
 
-	d = malloc(sizeof(*d));
-	if(!d) return 0;
+	if(stripe_blocks<=0) return 0;
 
-	d->fd = open(diskname,O_CREAT|O_RDWR,0777);
-	if(d->fd<0) {
+	d = calloc(1,sizeof(*d));
+	names = strdup(disknames);
+	if(!d || !names) {
+		free(d);
+		free(names);
+		return 0;
+	}
+
+	d->nmembers = 1;
+	for(i=0;names[i];i++) {
+		if(names[i]==',') d->nmembers++;
+	}
+	d->fds = d->nmembers<=DISK_MAX_MEMBERS ? malloc(d->nmembers*sizeof(int)) : 0;
+	if(!d->fds) {
+		free(names);
 		free(d);
 		return 0;
 	}
 
 	d->block_size = BLOCK_SIZE;
 	d->nblocks = nblocks;
+	d->size = (off_t)nblocks*BLOCK_SIZE;
+	d->stripe = (off_t)stripe_blocks*BLOCK_SIZE;
+
+	/* every member holds the same number of whole stripe rows */
+	off_t row = d->stripe*d->nmembers;
+	off_t member_size = d->nmembers==1 ? d->size : (d->size+row-1)/row*d->stripe;
+
+	int nopen, ok = 1;
+	name = strtok_r(names,",",&rest);
+	for(nopen=0;nopen<d->nmembers;nopen++) {
+		d->fds[nopen] = name ? open(name,O_CREAT|O_RDWR,0777) : -1;
+		if(d->fds[nopen]<0) {
+			ok = 0;
+			break;
+		}
+		int known = disk_label_check(d,nopen,&id);
+		if(known<0) mismatch = 1;
+		if(known==0) nfresh++;
+		name = strtok_r(0,",",&rest);
+	}
+	free(names);
+
+	/* a striped disk is either all new or all from the same layout */
+	if(ok && (mismatch || (nfresh && nfresh!=d->nmembers))) {
+		if(d->nmembers==1) {
+			fprintf(stderr,"disk_open: %s is one member of a striped disk\n",disknames);
+		} else {
+			fprintf(stderr,"disk_open: %s was not striped as %d files of %d blocks with %d blocks per unit\n",
+				disknames,d->nmembers,nblocks,stripe_blocks);
+		}
+		errno = EINVAL;
+		ok = 0;
+	}
+
+	struct disk_label label;
+	memset(&label,0,sizeof(label));
+	label.magic = DISK_LABEL_MAGIC;
+	label.id = nfresh ? (uint32_t)time(0)^((uint32_t)getpid()<<16) : id;
+	label.nmembers = d->nmembers;
+	label.stripe = d->stripe;
+	label.size = d->size;
 
-	if(ftruncate(d->fd,d->nblocks*d->block_size)<0) {
-		close(d->fd);
+	for(i=0;ok && i<d->nmembers;i++) {
+		if(ftruncate(d->fds[i],member_size)<0) ok = 0;
+		if(!ok || d->nmembers==1) continue;
+		label.member = i;
+		if(pwrite(d->fds[i],&label,sizeof(label),member_size)!=sizeof(label)) ok = 0;
+	}
+	if(!ok) {
+		for(i=0;i<nopen;i++) {
+			close(d->fds[i]);
+		}
+		free(d->fds);
 		free(d);
 		return 0;
 	}
+	d->fd = d->fds[0];
+	pthread_mutex_init(&d->lock,0);
+
+	/* a member without a worker has its share moved by the requesting thread */
+	d->workers = d->nmembers>1 ? calloc(d->nmembers,sizeof(struct disk_worker)) : 0;
+	for(i=0;d->workers && i<d->nmembers;i++) {
+		struct disk_worker *w = &d->workers[i];
+		pthread_mutex_init(&w->lock,0);
+		pthread_cond_init(&w->wake,0);
+		pthread_cond_init(&w->done,0);
+		w->started = !pthread_create(&w->thread,0,disk_worker_run,w);
+	}
 
 	return d;
 }
 
+/*
+Serve the queued request nearest the head, ties going to the oldest, and
+charge its simulated time. Returns the device clock when it is done.
+*/
+
+static int64_t disk_serve( struct disk *d, int *served )
+{
+	struct disk_model *m = &d->model;
+	int i, best = 0;
+	off_t best_distance = -1;
+
+	for(i=0;i<d->nqueued;i++) {
+		off_t distance = d->queue[i].offset>d->head ? d->queue[i].offset-d->head : d->head-d->queue[i].offset;
+		if(d->queue[i].op==DISK_OP_DISCARD) distance = 0;
+		if(best_distance<0 || distance<best_distance) {
+			best = i;
+			best_distance = distance;
+		}
+	}
+
+	struct disk_request r = d->queue[best];
+	memmove(&d->queue[best],&d->queue[best+1],(d->nqueued-best-1)*sizeof(r));
+	d->nqueued--;
+
+	int64_t cost = m->request_ns;
+	if(r.op!=DISK_OP_DISCARD) {
+		int64_t blocks = best_distance/BLOCK_SIZE;
+		if(blocks) {
+			int64_t seek = blocks*m->seek_ns;
+			cost += seek<m->seek_max_ns ? seek : m->seek_max_ns;
+			d->stats.seeks++;
+			d->stats.seek_distance += blocks;
+		}
+		cost += (int64_t)r.length*1000/m->bandwidth;
+		d->head = r.offset+r.length;
+	}
+
+	d->stats.busy_ns += cost;
+	switch(r.op) {
+		case DISK_OP_READ:
+			d->stats.read_ns += cost;
+			d->stats.read_wait_ns += d->stats.busy_ns-r.issued;
+			break;
+		case DISK_OP_WRITE:   d->stats.write_ns += cost; break;
+		case DISK_OP_DISCARD: d->stats.discard_ns += cost; break;
+	}
+	if(served) *served = best;
+	return d->stats.busy_ns;
+}
+
+/*
+Count a request of "length" bytes at "offset" and, with a model, queue it on
+the simulated device. A read waits for itself to be served.
+*/
+
+static void disk_account( struct disk *d, int op, off_t offset, long length )
+{
+	pthread_mutex_lock(&d->lock);
+	switch(op) {
+		case DISK_OP_READ:    d->stats.reads++; d->stats.bytes_read += length; break;
+		case DISK_OP_WRITE:   d->stats.writes++; d->stats.bytes_written += length; break;
+		case DISK_OP_DISCARD: d->stats.discards++; d->stats.bytes_discarded += length; break;
+	}
+
+	if(d->modelled) {
+		if(d->nqueued==d->model.queue_depth) disk_serve(d,0);
+
+		int slot = d->nqueued++;
+		d->queue[slot].op = op;
+		d->queue[slot].offset = offset;
+		d->queue[slot].length = length;
+		d->queue[slot].issued = d->stats.busy_ns;
+
+		/* the read sits at "slot" until it is served or the ones before it are */
+		while(op==DISK_OP_READ) {
+			int served;
+			disk_serve(d,&served);
+			if(served==slot) break;
+			if(served<slot) slot--;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+}
+
+int disk_set_model( struct disk *d, const struct disk_model *model )
+{
+	if(model && (model->request_ns<0 || model->seek_ns<0 || model->seek_max_ns<0 || model->bandwidth<=0
+	   || model->queue_depth<1 || model->queue_depth>DISK_QUEUE_MAX)) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	while(d->nqueued) disk_serve(d,0);
+	d->modelled = model!=0;
+	if(model) d->model = *model;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+void disk_stats( struct disk *d, struct disk_stats *stats, int reset )
+{
+	pthread_mutex_lock(&d->lock);
+	while(d->nqueued) disk_serve(d,0);
+	*stats = d->stats;
+	if(reset) memset(&d->stats,0,sizeof(d->stats));
+	pthread_mutex_unlock(&d->lock);
+}
+
+/*
+Find where byte "offset" of the disk lives: which member, and where in that
+member's file. Returns how many bytes from there on stay in the same member.
+*/
+
+static long disk_map( struct disk *d, off_t offset, int *member, off_t *member_offset )
+{
+	if(d->nmembers==1) {
+		*member = 0;
+		*member_offset = offset;
+		return d->size-offset;
+	}
+	off_t unit = offset/d->stripe;
+	*member = unit%d->nmembers;
+	*member_offset = unit/d->nmembers*d->stripe + offset%d->stripe;
+	return d->stripe - offset%d->stripe;
+}
+
+/* moves one member's share of a request, a stripe unit at a time */
+static void *disk_part_io( void *arg )
+{
+	struct disk_part *part = arg;
+	struct disk *d = part->d;
+	off_t offset = part->start;
+
+	while(offset<part->end) {
+		int member;
+		off_t member_offset;
+		long chunk = disk_map(d,offset,&member,&member_offset);
+		if(chunk>part->end-offset) chunk = part->end-offset;
+		unsigned char *data = part->data+(offset-part->base);
+
+		long moved = 0;
+		while(moved<chunk) {
+			ssize_t n = part->write ? pwrite(d->fds[member],data+moved,chunk-moved,member_offset+moved)
+			                        : pread(d->fds[member],data+moved,chunk-moved,member_offset+moved);
+			if(n<0 && errno==EINTR) continue;
+			if(n<=0) {
+				part->error = n<0 ? errno : EIO;
+				return part;
+			}
+			moved += n;
+		}
+
+		/* skip the units that belong to the other members */
+		offset += chunk+(off_t)(d->nmembers-1)*d->stripe;
+	}
+	return 0;
+}
+
+/* takes the shares queued for one member until the disk is closed */
+static void *disk_worker_run( void *arg )
+{
+	struct disk_worker *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;) {
+		while(!w->head && !w->stop) pthread_cond_wait(&w->wake,&w->lock);
+		struct disk_part *part = w->head;
+		if(!part) break;
+		w->head = part->next;
+		if(!w->head) w->tail = 0;
+		pthread_mutex_unlock(&w->lock);
+
+		disk_part_io(part);
+
+		pthread_mutex_lock(&w->lock);
+		part->done = 1;
+		pthread_cond_broadcast(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+/*
+Read or write "length" bytes at byte "offset" of the disk. When the request
+spans several members, each member's share is handed to that member's worker
+while the calling thread moves the first one.
+Returns 0, or the errno of the first failure.
+*/
+
+static int disk_io( struct disk *d, off_t offset, long length, unsigned char *data, int write )
+{
+	struct disk_part parts[DISK_MAX_MEMBERS];
+	struct disk_worker *workers[DISK_MAX_MEMBERS];
+	int i, nparts = 0, error = 0;
+
+	/* the first unit of the range on each member starts that member's share */
+	off_t next = offset;
+	while(next<offset+length && nparts<d->nmembers) {
+		int member;
+		off_t member_offset;
+		long span = disk_map(d,next,&member,&member_offset);
+
+		parts[nparts].d = d;
+		parts[nparts].start = next;
+		parts[nparts].end = offset+length;
+		parts[nparts].base = offset;
+		parts[nparts].data = data;
+		parts[nparts].write = write;
+		parts[nparts].error = 0;
+		parts[nparts].done = 0;
+		parts[nparts].next = 0;
+		workers[nparts] = d->workers && d->workers[member].started ? &d->workers[member] : 0;
+		nparts++;
+		next += span;
+	}
+
+	for(i=1;i<nparts;i++) {
+		struct disk_worker *w = workers[i];
+		if(!w) {
+			disk_part_io(&parts[i]);
+			continue;
+		}
+		pthread_mutex_lock(&w->lock);
+		if(w->tail) w->tail->next = &parts[i];
+		else w->head = &parts[i];
+		w->tail = &parts[i];
+		pthread_cond_signal(&w->wake);
+		pthread_mutex_unlock(&w->lock);
+	}
+	if(nparts>0) disk_part_io(&parts[0]);
+	for(i=1;i<nparts;i++) {
+		struct disk_worker *w = workers[i];
+		if(!w) continue;
+		pthread_mutex_lock(&w->lock);
+		while(!parts[i].done) pthread_cond_wait(&w->done,&w->lock);
+		pthread_mutex_unlock(&w->lock);
+	}
+	for(i=0;i<nparts && !error;i++) {
+		error = parts[i].error;
+	}
+	return error;
+}
+
 void disk_write( struct disk *d, int block, const unsigned char *data )
 {
 	if(block<0 || block>=d->nblocks) {
 		fprintf(stderr,"disk_write: invalid block #%d\n",block);
 		abort();
 	}
+	disk_account(d,DISK_OP_WRITE,(off_t)block*d->block_size,d->block_size);
 
-	int actual = pwrite(d->fd,(char*)data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_write: failed to write block #%d: %s\n",block,strerror(errno));
+	int error = disk_io(d,(off_t)block*d->block_size,d->block_size,(unsigned char*)data,1);
+	if(error) {
+		fprintf(stderr,"disk_write: failed to write block #%d: %s\n",block,strerror(error));
 		abort();
 	}
 }
@@ -69,12 +491,91 @@ void disk_read( struct disk *d, int block, unsigned char *data )
 		fprintf(stderr,"disk_read: invalid block #%d\n",block);
 		abort();
 	}
+	disk_account(d,DISK_OP_READ,(off_t)block*d->block_size,d->block_size);
+
+	int error = disk_io(d,(off_t)block*d->block_size,d->block_size,data,0);
+	if(error) {
+		fprintf(stderr,"disk_read: failed to read block #%d: %s\n",block,strerror(error));
+		abort();
+	}
+}
+
+void disk_read_blocks( struct disk *d, int block, int nblocks, unsigned char *data )
+{
+	if(block<0 || nblocks<0 || block+nblocks>d->nblocks) {
+		fprintf(stderr,"disk_read_blocks: invalid blocks #%d-%d\n",block,block+nblocks-1);
+		abort();
+	}
+	disk_account(d,DISK_OP_READ,(off_t)block*d->block_size,(long)nblocks*d->block_size);
+
+	int error = disk_io(d,(off_t)block*d->block_size,(long)nblocks*d->block_size,data,0);
+	if(error) {
+		fprintf(stderr,"disk_read_blocks: failed to read blocks #%d-%d: %s\n",block,block+nblocks-1,strerror(error));
+		abort();
+	}
+}
+
+void disk_write_blocks( struct disk *d, int block, int nblocks, const unsigned char *data )
+{
+	if(block<0 || nblocks<0 || block+nblocks>d->nblocks) {
+		fprintf(stderr,"disk_write_blocks: invalid blocks #%d-%d\n",block,block+nblocks-1);
+		abort();
+	}
+	disk_account(d,DISK_OP_WRITE,(off_t)block*d->block_size,(long)nblocks*d->block_size);
+
+	int error = disk_io(d,(off_t)block*d->block_size,(long)nblocks*d->block_size,(unsigned char*)data,1);
+	if(error) {
+		fprintf(stderr,"disk_write_blocks: failed to write blocks #%d-%d: %s\n",block,block+nblocks-1,strerror(error));
+		abort();
+	}
+}
+
+int disk_discard( struct disk *d, int block, int nblocks )
+{
+	if(block<0 || nblocks<0 || block+nblocks>d->nblocks) {
+		fprintf(stderr,"disk_discard: invalid blocks #%d-%d\n",block,block+nblocks-1);
+		abort();
+	}
+	disk_account(d,DISK_OP_DISCARD,(off_t)block*d->block_size,(long)nblocks*d->block_size);
+
+	/* each member's share of the range is one contiguous range of its file */
+	off_t offset = (off_t)block*d->block_size;
+	off_t end = offset+(off_t)nblocks*d->block_size;
+	int i;
+	for(i=0;i<d->nmembers && offset<end;i++) {
+		int member;
+		off_t member_offset, last_offset;
+		long span = disk_map(d,offset,&member,&member_offset);
+
+		/* the last byte of the range on this member */
+		off_t last = end-1;
+		if(d->nmembers>1) {
+			off_t unit = last/d->stripe;
+			off_t back = (unit%d->nmembers-member+d->nmembers)%d->nmembers;
+			last = back ? (unit-back)*d->stripe+d->stripe-1 : last;
+		}
+		if(last<offset) break;
+		disk_map(d,last,&member,&last_offset);
+
+		int result;
+		do {
+			result = fallocate(d->fds[member],FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,member_offset,last_offset-member_offset+1);
+		} while(result<0 && errno==EINTR);
+		if(result<0) return -1;
+		offset += span;
+	}
+	return 0;
+}
 
-	int actual = pread(d->fd,(char*)data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_read: failed to read block #%d: %s\n",block,strerror(errno));
+int disk_set_block_size( struct disk *d, int block_size )
+{
+	if(block_size<=0 || block_size>BLOCK_SIZE_MAX || (block_size&(block_size-1))) {
+		fprintf(stderr,"disk_set_block_size: invalid block size %d\n",block_size);
 		abort();
 	}
+	d->block_size = block_size;
+	d->nblocks = d->size/block_size;
+	return d->nblocks;
 }
 
 int disk_nblocks( struct disk *d )
@@ -82,8 +583,165 @@ int disk_nblocks( struct disk *d )
 	return d->nblocks;
 }
 
+/*
+Move up to "length" bytes from "in_fd" to "out_fd" without a user-space copy
+where the kernel allows it. A null offset pointer means the descriptor's own
+file position is used and advanced. Tries copy_file_range, then splice when
+either end is a pipe, then maps the input and writes from the mapping, and
+only bounces through a buffer when the input cannot be mapped at all.
+Returns the number of bytes moved (short only at end of input), or -1.
+*/
+
+static long disk_transfer( int in_fd, off_t *in_off, int out_fd, off_t *out_off, long length )
+{
+	long total = 0;
+	ssize_t n;
+	struct stat in_info, out_info;
+
+	while(total<length) {
+		n = copy_file_range(in_fd,in_off,out_fd,out_off,length-total,0);
+		if(n<0 && errno==EINTR) continue;
+		if(n<=0) break;
+		total += n;
+	}
+	if(total==length || n==0) return total;
+	if(total>0) return -1;
+
+	if(fstat(in_fd,&in_info)<0 || fstat(out_fd,&out_info)<0) return -1;
+
+	if(S_ISFIFO(in_info.st_mode) || S_ISFIFO(out_info.st_mode)) {
+		while(total<length) {
+			n = splice(in_fd,in_off,out_fd,out_off,length-total,SPLICE_F_MOVE);
+			if(n<0 && errno==EINTR) continue;
+			if(n<=0) break;
+			total += n;
+		}
+		if(total==length || n==0) return total;
+		if(total>0) return -1;
+	}
+
+	off_t start = in_off ? *in_off : lseek(in_fd,0,SEEK_CUR);
+
+	if(S_ISREG(in_info.st_mode) && start>=0) {
+		if(start>=in_info.st_size) return 0;
+		if(length>in_info.st_size-start) length = in_info.st_size-start;
+
+		long page = sysconf(_SC_PAGESIZE);
+		off_t base = start - start%page;
+		size_t span = length + (start-base);
+
+		unsigned char *map = mmap(0,span,PROT_READ,MAP_SHARED,in_fd,base);
+		if(map!=MAP_FAILED) {
+			madvise(map,span,MADV_SEQUENTIAL);
+			const unsigned char *src = map + (start-base);
+			while(total<length) {
+				if(out_off) {
+					n = pwrite(out_fd,src+total,length-total,*out_off+total);
+				} else {
+					n = write(out_fd,src+total,length-total);
+				}
+				if(n<0 && errno==EINTR) continue;
+				if(n<=0) break;
+				total += n;
+			}
+			munmap(map,span);
+			if(out_off) *out_off += total;
+			if(in_off) *in_off += total;
+			else lseek(in_fd,start+total,SEEK_SET);
+			return total==length ? total : -1;
+		}
+	}
+
+	unsigned char buffer[BLOCK_SIZE];
+	while(total<length) {
+		long chunk = length-total < BLOCK_SIZE ? length-total : BLOCK_SIZE;
+		n = in_off ? pread(in_fd,buffer,chunk,*in_off) : read(in_fd,buffer,chunk);
+		if(n<0 && errno==EINTR) continue;
+		if(n<0) return -1;
+		if(n==0) break;
+		if(in_off) *in_off += n;
+
+		ssize_t done = 0;
+		while(done<n) {
+			ssize_t w = out_off ? pwrite(out_fd,buffer+done,n-done,*out_off) : write(out_fd,buffer+done,n-done);
+			if(w<0 && errno==EINTR) continue;
+			if(w<=0) return -1;
+			if(out_off) *out_off += w;
+			done += w;
+		}
+		total += n;
+	}
+	return total;
+}
+
+/*
+Move "length" bytes between the disk at "offset" and the stream "fd", one
+stripe unit at a time since the stream has to be consumed in order.
+*/
+
+static int disk_stream( struct disk *d, off_t offset, long length, int fd, int in )
+{
+	long total = 0;
+	while(total<length) {
+		int member;
+		off_t member_offset;
+		long chunk = disk_map(d,offset+total,&member,&member_offset);
+		if(chunk>length-total) chunk = length-total;
+
+		long n = in ? disk_transfer(fd,0,d->fds[member],&member_offset,chunk)
+		            : disk_transfer(d->fds[member],&member_offset,fd,0,chunk);
+		if(n<0) return total ? total : -1;
+		total += n;
+		if(n<chunk) break;
+	}
+	return total;
+}
+
+int disk_copyin( struct disk *d, int block, int nblocks, int fd )
+{
+	if(block<0 || nblocks<0 || block+nblocks>d->nblocks) {
+		fprintf(stderr,"disk_copyin: invalid blocks #%d-%d\n",block,block+nblocks-1);
+		abort();
+	}
+
+	int moved = disk_stream(d,(off_t)block*d->block_size,(long)nblocks*d->block_size,fd,1);
+	if(moved>0) disk_account(d,DISK_OP_WRITE,(off_t)block*d->block_size,moved);
+	return moved;
+}
+
+int disk_copyout( struct disk *d, int block, int nblocks, int fd )
+{
+	if(block<0 || nblocks<0 || block+nblocks>d->nblocks) {
+		fprintf(stderr,"disk_copyout: invalid blocks #%d-%d\n",block,block+nblocks-1);
+		abort();
+	}
+
+	int moved = disk_stream(d,(off_t)block*d->block_size,(long)nblocks*d->block_size,fd,0);
+	if(moved>0) disk_account(d,DISK_OP_READ,(off_t)block*d->block_size,moved);
+	return moved;
+}
+
 void disk_close( struct disk *d )
 {
-	close(d->fd);
+	int i;
+	for(i=0;d->workers && i<d->nmembers;i++) {
+		struct disk_worker *w = &d->workers[i];
+		if(w->started) {
+			pthread_mutex_lock(&w->lock);
+			w->stop = 1;
+			pthread_cond_signal(&w->wake);
+			pthread_mutex_unlock(&w->lock);
+			pthread_join(w->thread,0);
+		}
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->wake);
+		pthread_cond_destroy(&w->done);
+	}
+	free(d->workers);
+	for(i=0;i<d->nmembers;i++) {
+		close(d->fds[i]);
+	}
+	free(d->fds);
+	pthread_mutex_destroy(&d->lock);
 	free(d);
 }
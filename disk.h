@@ -7,7 +7,13 @@ Make all of your changes to main.c instead.
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdint.h>
+
 #define BLOCK_SIZE 4096
+#define BLOCK_SIZE_MAX 65536
+#define DISK_STRIPE_BLOCKS 16  /* default stripe unit, in BLOCK_SIZE blocks */
+#define DISK_MAX_MEMBERS 32
+#define DISK_QUEUE_MAX 256     /* deepest request queue a model can have */
 
 /*
 Create a new virtual disk in the file "filename", with the given number of blocks.
@@ -17,7 +23,23 @@ Returns a pointer to a new disk object, or null on failure.
 struct disk * disk_open( const char *filename, int blocks );
 
 /*
-Write exactly BLOCK_SIZE bytes to a given block on the virtual disk.
+Open a disk of "blocks" blocks striped across several image files, given as
+a comma separated list in "filenames" (at most DISK_MAX_MEMBERS). Consecutive
+runs of "stripe_blocks" blocks go to the files in turn, and requests that
+span several files are carried out on all of them at once. disk_open is the
+same as this with DISK_STRIPE_BLOCKS, so it also accepts such a list; with a
+single file the image has the usual flat layout.
+
+Each file of a striped disk ends with a label recording its place in the
+layout. Opening the files in another order, with another stripe unit or
+size, or one of them alone as a flat image fails with errno EINVAL.
+*/
+
+struct disk * disk_open_striped( const char *filenames, int blocks, int stripe_blocks );
+
+/*
+Write exactly one block, of the disk's current block size (see
+disk_set_block_size), to a given block on the virtual disk.
 "d" must be a pointer to a virtual disk, "block" is the block number,
 and "data" is a pointer to the data to write.
 */
@@ -25,13 +47,106 @@ and "data" is a pointer to the data to write.
 void disk_write( struct disk *d, int block, const unsigned char *data );
 
 /*
-Read exactly BLOCK_SIZE bytes from a given block on the virtual disk.
+Read exactly one block, of the disk's current block size (see
+disk_set_block_size), from a given block on the virtual disk.
 "d" must be a pointer to a virtual disk, "block" is the block number,
 and "data" is a pointer to where the data will be placed.
 */
 
 void disk_read( struct disk *d, int block, unsigned char *data );
 
+/*
+Read or write "nblocks" consecutive blocks starting at "block" with a single
+request. "data" must hold "nblocks" blocks of the disk's current block size.
+*/
+
+void disk_read_blocks( struct disk *d, int block, int nblocks, unsigned char *data );
+void disk_write_blocks( struct disk *d, int block, int nblocks, const unsigned char *data );
+
+/*
+Copy "nblocks" whole blocks, starting at "block", from the host file descriptor
+"fd" (at its current position) onto the virtual disk, or from the virtual disk to
+"fd". The data is moved inside the kernel where possible and never passes through
+a caller-supplied buffer. The file position of "fd" is advanced by the amount moved.
+Returns the number of bytes moved, which is short only at end of input, or -1 on error.
+*/
+
+int disk_copyin( struct disk *d, int block, int nblocks, int fd );
+int disk_copyout( struct disk *d, int block, int nblocks, int fd );
+
+/*
+Give the host back the storage behind "nblocks" blocks starting at "block" by
+punching a hole in the image file. The blocks read as zeros afterwards.
+Returns 0 on success, or -1 if the host file cannot punch holes, in which
+case the blocks are left unchanged.
+*/
+
+int disk_discard( struct disk *d, int block, int nblocks );
+
+/*
+Change the size of the blocks the disk is addressed in, which starts out as
+BLOCK_SIZE. "block_size" must be a power of two no larger than BLOCK_SIZE_MAX.
+The disk keeps its size in bytes, so the number of blocks changes with it
+(a partial block at the end is not used). Returns the new number of blocks.
+*/
+
+int disk_set_block_size( struct disk *d, int block_size );
+
+/*
+Timing of a simulated device. Nothing is slowed down: every request still
+goes to the image at once, and the model only adds up how long the device
+would have taken. A request costs "request_ns", plus a seek of "seek_ns" for
+every BLOCK_SIZE block between where the last one ended and where it starts
+(at most "seek_max_ns"), plus its bytes at "bandwidth" MB per second.
+
+Requests wait in a queue of "queue_depth" entries, which the device serves
+nearest one first, so a deeper queue lets it cut seeks by reordering. Writes
+and discards are queued and the caller goes on; a read is queued too, but
+the device keeps serving until the read is done, as its caller needs the
+data. A depth of 1 serves everything in the order it was issued. Discards
+cost only "request_ns" and do not move the head.
+*/
+
+struct disk_model {
+	int64_t request_ns;
+	int64_t seek_ns;
+	int64_t seek_max_ns;
+	int64_t bandwidth;
+	int queue_depth;
+};
+
+/*
+What a disk has done since it was opened or since disk_stats was last asked
+to reset. The times are simulated, in nanoseconds, and stay 0 with no model.
+"busy_ns" is the total; "read_wait_ns" is how long reads took from being
+issued to being done, counting the queued requests served before them.
+Seek distances are in BLOCK_SIZE blocks.
+*/
+
+struct disk_stats {
+	int64_t reads, writes, discards;
+	int64_t bytes_read, bytes_written, bytes_discarded;
+	int64_t read_ns, write_ns, discard_ns;
+	int64_t read_wait_ns;
+	int64_t seeks, seek_distance;
+	int64_t busy_ns;
+};
+
+/*
+Start accounting simulated time with "model", replacing any earlier one
+once its queue is served. A null model turns the accounting off; the request
+counts are kept either way. Returns 0, or -1 if the model is not valid.
+*/
+
+int disk_set_model( struct disk *d, const struct disk_model *model );
+
+/*
+Serve every queued request and copy the statistics into "stats", then
+clear them if "reset" is set.
+*/
+
+void disk_stats( struct disk *d, struct disk_stats *stats, int reset );
+
 /*
 Return the number of blocks in the virtual disk.
 */
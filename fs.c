@@ -10,19 +10,34 @@ Make your changes here.
 #include "fs.h"
 #include "disk.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 extern struct disk *thedisk;
 
 #define FS_MAGIC           0x30341003
-#define INODES_PER_BLOCK   128
-#define POINTERS_PER_INODE 3
-#define POINTERS_PER_BLOCK 1024
+#define POINTERS_PER_INODE 3    //direct pointers unless format asks for more
+#define POINTERS_PER_INODE_MAX 27 //fills a 128 byte inode
+#define INODE_SIZE_MAX     128
+#define BLOCKS_PER_GROUP   1024 //allocation groups, tracked in memory only
+#define ALLOC_CHUNK        8    //a new run starts on a fully free chunk
+#define DELAYED_MAX_BYTES  (16 << 20) //buffered file data before everything is flushed
+#define FSCK_BATCH         64   //blocks fetched per read while checking
+#define FLUSH_BATCH        64   //neighbouring blocks written out with one request
+#define FSCK_MAX_THREADS   8
+#define DEDUP_MAGIC        0x44445550 //content index saved in inode 0
+#define SHARED_MAGIC       0x53484152 //shared block map saved in inode 0
+#define META_INODE         0    //holds the dedup index and shared block map
+#define FS_SHARED_MAP      1    //feature: blocks may only be shared as the map says
+#define FS_SHARED_STALE    2    //the saved map is being replaced or did not fit, trust any sharing
 
 typedef struct fs_superblock fs_superblock;
 struct fs_superblock {
@@ -30,40 +45,168 @@ struct fs_superblock {
 	int32_t nblocks;
 	int32_t ninodeblocks;
 	int32_t ninodes;
+	int32_t block_size; //0 on older images, which use BLOCK_SIZE
+	int32_t inode_size; //bytes per inode on disk, 0 for 32
+	int32_t ndirect; //direct pointers per inode, 0 for POINTERS_PER_INODE
+	int32_t ninodemap; //inode blocks listed in the inode map
+	int32_t features; //FS_SHARED_MAP, 0 on older images
+	int32_t imapnext; //first inode map block after block 0, 0 if none
 };
 
+// With ninodeblocks 0 there is no fixed inode table. Inode blocks are taken
+// from the data area as files are created, and the inode map lists the disk
+// block of each inode block in turn. The map starts in the rest of block 0
+// after the superblock and carries on in map blocks taken from the data area
+// as it fills, each holding the next map block followed by more entries.
+// ninodes is then the most inodes the disk could hold.
+
+// on disk an inode holds ndirect direct pointers followed by the indirect one,
+// padded to inode_size. in memory there is always room for the most
 struct fs_inode {
 	int32_t isvalid;
 	int32_t size;
 	int64_t ctime;
-	int32_t direct[POINTERS_PER_INODE];
+	int32_t direct[POINTERS_PER_INODE_MAX];
 	int32_t indirect;
 };
 
+// sized for the largest block, only the first fs.geo.block_size bytes are used
 union fs_block {
 	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
-	int pointers[POINTERS_PER_BLOCK];
-	unsigned char data[BLOCK_SIZE];
+	int pointers[BLOCK_SIZE_MAX / sizeof(int)];
+	unsigned char data[BLOCK_SIZE_MAX];
+};
+
+// Layout of the filesystem on disk, worked out from the superblock so that
+// offsets are found with shifts and masks
+typedef struct fs_geometry fs_geometry;
+struct fs_geometry {
+    int block_size;
+    int block_shift;
+    int block_mask;
+    int ndirect; //direct pointers per inode
+    int nindirect; //pointers per indirect block
+    int nlblocks; //largest file, in blocks
+    int inode_shift; //log2 of bytes per inode
+    int inodes_shift; //log2 of inodes per block
 };
 
 // Created to keep track of the currently mounted FS
 typedef struct FileSystem FileSystem;
 struct FileSystem {
     struct fs_superblock meta; //keeps track of current sb in fs
+    fs_geometry geo;
+    int32_t *imap; //disk block of each inode block, null for a fixed table
+    int nimap; //inode blocks in use
+    int imap_size; //entries imap has room for
+    int32_t *imap_chain; //map blocks after block 0, in order
+    int nimap_chain;
+    bool *inode_blocks; //data area blocks holding inodes or the inode map
     struct disk *disk;
     bool *free_blocks; //keeps track of currently free blocks in bitmap
+    uint32_t *refs; //pointers to each block, clones share blocks until written
+    int ngroups;
+    int *group_free; //free blocks in each allocation group
+    int nfree;
+    int reserved; //free blocks promised to buffered data
+    struct fs_dirty *dirty; //inodes with buffered data
+    int nbuffered;
+    bool dedup; //share blocks with identical contents on write
+    struct fs_dedup_entry *index; //content hash -> block, a hint checked before use
+    int index_size;
+    int index_count;
+    int32_t discard_start; //freed blocks not yet handed back to the host
+    int discard_count;
+    bool shared_changed; //sharing differs from the map saved in inode 0
+};
+
+// consecutive blocks with the same number of pointers, in the shared block map
+typedef struct fs_shared_run fs_shared_run;
+struct fs_shared_run {
+    int32_t start;
+    int32_t length;
+    uint32_t refs;
+};
+
+typedef struct fs_dedup_entry fs_dedup_entry;
+struct fs_dedup_entry {
+    uint64_t hash;
+    int32_t block; //0 for an empty slot
+    int32_t unused;
+};
+
+// File data written to holes is kept here, by logical block,
+// and only given disk blocks when the inode is flushed
+typedef struct fs_dirty fs_dirty;
+struct fs_dirty {
+    int inumber;
+    int nblocks; //buffered blocks
+    bool indirect; //a block is reserved for a new indirect block
+    unsigned char **blocks; //one slot per logical block
+    fs_dirty *next;
+};
+
+// Maps the logical blocks of one inode to disk blocks,
+// keeping its indirect block in memory between lookups
+typedef struct fs_blockmap fs_blockmap;
+struct fs_blockmap {
+    int inumber;
+    struct fs_inode *inode;
+    union fs_block indirect; //copy of inode->indirect once loaded
+    bool loaded;
+    bool dirty; //indirect must be written back
 };
 
-int32_t fs_allocate_free_block();
+int32_t fs_allocate_free_block(int32_t goal);
+int32_t fs_allocate_free_run(int32_t goal, int count);
+void fs_release_block(int32_t block);
+void fs_share_block(int32_t block);
+int32_t inode_goal(int inumber);
+bool fs_block_valid(int32_t block);
 void inode_load(int inumber, struct fs_inode *inode);
 void inode_save(int inumber, struct fs_inode *inode);
+void blockmap_init(fs_blockmap *map, int inumber, struct fs_inode *inode);
+int  blockmap_get(fs_blockmap *map, int lblock, bool alloc);
+bool blockmap_set(fs_blockmap *map, int lblock, int block);
+bool blockmap_unshare(fs_blockmap *map, int lblock);
+void blockmap_flush(fs_blockmap *map);
+fs_dirty *dirty_find(int inumber);
+unsigned char *dirty_block(int inumber, int lblock);
+void dirty_drop(int inumber);
+static unsigned char *dirty_buffer(int inumber, int lblock, bool hasIndirect);
+static bool blockmap_own_indirect(fs_blockmap *map);
+void blockmap_add_indirect(fs_blockmap *map, int32_t block);
+static int32_t dedup_match(fs_blockmap *map, int lblock, const unsigned char *data);
+static void dedup_insert(const unsigned char *data, int32_t block);
+static void meta_load();
+static int inode_delete( int inumber );
+static int inode_write( int inumber, const char *data, int length, int offset );
+static int fs_write_fd_dedup( int inumber, int fd, int length, int offset );
+static void meta_save();
+static uint32_t *shared_load();
+static void shared_change();
+static void fs_forget();
+static void super_save();
+static void fs_discard_flush();
+static bool geometry_load(const fs_superblock *super);
+static bool imap_load(const union fs_block *sblock);
+static int32_t imap_limit(int32_t nblocks);
+static int imap_first();
+static void imap_chain_save(int c);
+static int32_t inode_block(int index);
+static int32_t inode_block_add();
+static int inode_count();
+static void inode_unpack(const unsigned char *slot, struct fs_inode *inode);
 
 //FileSystem *fs;
 FileSystem fs = {0};
 
 // creates a new FS on disk, destroying any present data
-int fs_format()
+// block_size is a power of two from BLOCK_SIZE to BLOCK_SIZE_MAX, ndirect the
+// direct pointers in each inode and inode_ratio the bytes of disk per inode
+// in a fixed inode table. 0 picks the default for any of them: BLOCK_SIZE,
+// POINTERS_PER_INODE and inode blocks allocated as files are created
+int fs_format( int block_size, int ndirect, int inode_ratio )
 {
     if(fs.disk){
         printf("disk is already mounted\n");
@@ -73,30 +216,54 @@ int fs_format()
     //create super block
     union fs_block sblock = {{0}};
     sblock.super.magic = FS_MAGIC;
+    sblock.super.block_size = block_size ? block_size : BLOCK_SIZE;
+    sblock.super.ndirect = ndirect ? ndirect : POINTERS_PER_INODE;
+    sblock.super.inode_size = 32;
+    sblock.super.features = FS_SHARED_MAP;
+    while(sblock.super.inode_size < 20 + 4 * sblock.super.ndirect) {
+        sblock.super.inode_size *= 2;
+    }
+    if(inode_ratio < 0 || !geometry_load(&sblock.super)) {
+        printf("unsupported geometry\n");
+        return 0;
+    }
     int b = disk_nblocks(thedisk);
   
     sblock.super.nblocks = b;
     //printf("%d\n", block.super.nblocks);
 
-    //set aside 10% for inode blocks
-    if(b % 10) {
-        //printf("1: %d\n", (block.super.nblocks / 10) + 1);
-        sblock.super.ninodeblocks = (sblock.super.nblocks / 10) + 1;
-    }
-    else {
-        //printf("2: %d\n",(block.super.nblocks / 10));
-        sblock.super.ninodeblocks = (sblock.super.nblocks / 10);
+    if(inode_ratio) {
+        int64_t ninodes = (int64_t)b * fs.geo.block_size / inode_ratio;
+        sblock.super.ninodeblocks = (ninodes + (1 << fs.geo.inodes_shift) - 1) >> fs.geo.inodes_shift;
+        if(sblock.super.ninodeblocks < 1) {
+            sblock.super.ninodeblocks = 1;
+        }
+        if(sblock.super.ninodeblocks >= b) {
+            printf("disk is too small\n");
+            return 0;
+        }
+        //set total number of inodes
+        sblock.super.ninodes = sblock.super.ninodeblocks << fs.geo.inodes_shift;
+    } else {
+        //the map grows with the files, as far as the disk allows
+        sblock.super.ninodeblocks = 0;
+        sblock.super.ninodes = imap_limit(b);
     }
-    //set total number of inodes
-    sblock.super.ninodes = sblock.super.ninodeblocks * INODES_PER_BLOCK;
+    imap_load(&sblock);
 
     disk_write(thedisk, 0, sblock.data); //write superblock
-    
+
+    //punching out everything past the superblock clears the inode table
+    //and drops the old data from the image in one call
+    if(disk_discard(thedisk, 1, sblock.super.nblocks - 1) == 0) {
+        return 1;
+    }
+
     //clear the inode bitmap
     struct fs_inode inode;
     memset(&inode, 0, sizeof(inode)); //set inode to 0
 	int i;
-    for(i = 1; i < sblock.super.ninodes; i++) {
+    for(i = 0; i < inode_count(); i++) {
         inode_save(i, &inode); //save all inodes as 0
     }
 	return 1;
@@ -116,11 +283,18 @@ void fs_debug()
 	printf("    %d blocks\n",block.super.nblocks);
 	printf("    %d inode blocks\n",block.super.ninodeblocks);
 	printf("    %d inodes\n",block.super.ninodes);
+	if(!fs.disk && (!geometry_load(&block.super) || !imap_load(&block))) {
+		return;
+	}
+	printf("    %d byte blocks, %d direct pointers\n",fs.geo.block_size,fs.geo.ndirect);
+	if(fs.imap) {
+		printf("    %d inode blocks allocated\n",fs.nimap);
+	}
 
 	int i, k, l;
 
     //scan inodes 
-	for(i=0; i < block.super.ninodeblocks * INODES_PER_BLOCK; i++){
+	for(i=0; i < inode_count(); i++){
         
         //create inode and load the desired inode
         struct fs_inode inode;
@@ -132,7 +306,7 @@ void fs_debug()
             printf("    size: %u bytes\n", inode.size);
             printf("    created: %s", ctime(&inode.ctime));
             printf("    direct blocks:");
-            for(k=0; k<POINTERS_PER_INODE; k++){
+            for(k=0; k<fs.geo.ndirect; k++){
                 if(inode.direct[k]){
                     printf(" %u", inode.direct[k]);
                 }
@@ -146,7 +320,7 @@ void fs_debug()
                 printf("   indirect block: %u\n", inode.indirect);
                 printf("   indirect data blocks:");
 
-                for(l=0; l<POINTERS_PER_BLOCK; l++){
+                for(l=0; l<fs.geo.nindirect; l++){
                     if(indirect.pointers[l]){
                         printf(" %u", indirect.pointers[l]);
                     }
@@ -163,18 +337,18 @@ int fs_mount()
 {
     union fs_block block;
     disk_read(thedisk, 0, block.data); //read superblock 
+    if(block.super.magic != FS_MAGIC || !geometry_load(&block.super)) {
+        return 0;
+    }
 	int b = disk_nblocks(thedisk); //num blocks in the disk
     //error check
-    if(block.super.magic != FS_MAGIC || block.super.nblocks != b || block.super.ninodes != (block.super.ninodeblocks * INODES_PER_BLOCK)) {
+    if(block.super.nblocks != b || block.super.ninodeblocks < 0 || block.super.ninodeblocks >= b) {
 		return 0;
     }
-    //check that there are the correct number of inode blocks
-    if(!(b % 10)) {
-        if(block.super.ninodeblocks < (b / 10)) {
-            return 0;
-        }
+    if(block.super.ninodeblocks && block.super.ninodes != (block.super.ninodeblocks << fs.geo.inodes_shift)) {
+        return 0;
     }
-    else if(block.super.ninodeblocks < (b / 10) + 1) {
+    if(!imap_load(&block)) {
         return 0;
     }
 	
@@ -184,8 +358,17 @@ int fs_mount()
 
     //allocate space for bitmap 
     fs.free_blocks = calloc(fs.meta.nblocks, sizeof(bool));
-    if(!fs.free_blocks){
+    fs.refs = calloc(fs.meta.nblocks, sizeof(uint32_t));
+    fs.inode_blocks = fs.imap ? calloc(fs.meta.nblocks, sizeof(bool)) : 0;
+    if(!fs.free_blocks || !fs.refs || (fs.imap && !fs.inode_blocks)){
         printf("Calloc failed\n");
+        free(fs.free_blocks);
+        free(fs.refs);
+        free(fs.inode_blocks);
+        fs.free_blocks = 0;
+        fs.refs = 0;
+        fs.inode_blocks = 0;
+        fs.disk = 0;
         return 0;
     }
     //set super blcok and inode blocks to false right away 
@@ -200,31 +383,109 @@ int fs_mount()
     for(i= 0; i < fs.meta.ninodeblocks +1; i++){
         fs.free_blocks[i] = false;
     }
+    //inode blocks taken from the data area belong to the inode map
+    if(fs.imap) {
+        for(i = 0; i < fs.nimap; i++) {
+            fs.free_blocks[fs.imap[i]] = false;
+            fs.inode_blocks[fs.imap[i]] = true;
+            fs.refs[fs.imap[i]] = 1;
+        }
+        for(i = 0; i < fs.nimap_chain; i++) {
+            fs.free_blocks[fs.imap_chain[i]] = false;
+            fs.inode_blocks[fs.imap_chain[i]] = true;
+            fs.refs[fs.imap_chain[i]] = 1;
+        }
+    }
     
-    for(i = 0; i < fs.meta.ninodes; i++) {
+    //read each inode block once
+    union fs_block inodes;
+    for(i = 0; i < inode_count(); i++) {
         struct fs_inode inode;
-        inode_load(i, &inode);
+        int slot = i & ((1 << fs.geo.inodes_shift) - 1);
+        if(!slot) {
+            disk_read(thedisk, inode_block(i >> fs.geo.inodes_shift), inodes.data);
+        }
+        inode_unpack(inodes.data + (slot << fs.geo.inode_shift), &inode);
+        if(!inode.isvalid) {
+            continue;
+        }
         //iterate though the pointers in the inode
-        for(j = 0; j < POINTERS_PER_INODE; j++) {
-            if(inode.direct[j]) {
+        bool corrupt = false;
+        for(j = 0; j < fs.geo.ndirect; j++) {
+            if(inode.direct[j] && !fs_block_valid(inode.direct[j])) {
+                corrupt = true;
+            } else if(inode.direct[j]) {
                 fs.free_blocks[inode.direct[j]] = false; //mark the blocks in use
+                fs.refs[inode.direct[j]]++;
             }
         }
         //check for indirect blocks
-        if(inode.indirect) {        
+        if(inode.indirect && !fs_block_valid(inode.indirect)) {
+            corrupt = true;
+        } else if(inode.indirect) {        
             fs.free_blocks[inode.indirect] = false;
+            fs.refs[inode.indirect]++;
 
             union fs_block indirect_block;
 
             disk_read(thedisk, inode.indirect, indirect_block.data);
             //printf("hi\n");
             //iterate through the pointers in each block
-            for(k = 0; k < POINTERS_PER_BLOCK; k++) {
-                if(indirect_block.pointers[k]) {
+            for(k = 0; k < fs.geo.nindirect; k++) {
+                if(indirect_block.pointers[k] && !fs_block_valid(indirect_block.pointers[k])) {
+                    corrupt = true;
+                } else if(indirect_block.pointers[k]) {
                     fs.free_blocks[indirect_block.pointers[k]] = false; //mark the bitmap for blocks in use
+                    fs.refs[indirect_block.pointers[k]]++;
                 }
             }
         }
+        //never hand out blocks based on a broken inode
+        if(corrupt) {
+            printf("inode %d points outside the data area or into the inodes, run check first\n", i);
+            fs_forget();
+            return 0;
+        }
+    }
+
+    //count what is left free in each allocation group
+    fs.ngroups = (fs.meta.nblocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+    fs.group_free = calloc(fs.ngroups, sizeof(int));
+    if(!fs.group_free){
+        printf("Calloc failed\n");
+        fs_forget();
+        return 0;
+    }
+    fs.nfree = 0;
+    for(i = 0; i < fs.meta.nblocks; i++) {
+        if(fs.free_blocks[i]) {
+            fs.group_free[i / BLOCKS_PER_GROUP]++;
+            fs.nfree++;
+        }
+    }
+
+    //sharing the map does not account for means two inodes were given one block
+    uint32_t *expected = shared_load();
+    int crosslinked = 0;
+    for(i = fs.meta.ninodeblocks + 1; expected && i < fs.meta.nblocks; i++) {
+        if(fs.refs[i] > 1 && fs.refs[i] > expected[i]) {
+            crosslinked++;
+        }
+    }
+    free(expected);
+    if(crosslinked) {
+        printf("%d blocks are used by more inodes than the shared block map allows, run check first\n", crosslinked);
+        fs_forget();
+        return 0;
+    }
+
+    meta_load();
+    fs.shared_changed = (fs.meta.features & FS_SHARED_STALE) != 0;
+
+    //an older image starts keeping the map, empty as nothing is shared yet
+    if(!(fs.meta.features & FS_SHARED_MAP)) {
+        fs.meta.features |= FS_SHARED_MAP;
+        meta_save();
     }
 	return 1;
 }
@@ -238,9 +499,22 @@ int fs_create()
         return 0;
     }
     int i;
-    for( i = 1; i < fs.meta.ninodeblocks * INODES_PER_BLOCK; i++) {
+    union fs_block inodes;
+    for( i = 1; i < fs.meta.ninodes; i++) {
         struct fs_inode inode;
-        inode_load(i, &inode);
+        int slot = i & ((1 << fs.geo.inodes_shift) - 1);
+        if(i >= inode_count()) {
+            //every inode block is full, start a new one
+            if(!inode_block_add()) {
+                break;
+            }
+            memset(&inode, 0, sizeof(inode));
+        } else {
+            if(!slot || i == 1) {
+                disk_read(thedisk, inode_block(i >> fs.geo.inodes_shift), inodes.data);
+            }
+            inode_unpack(inodes.data + (slot << fs.geo.inode_shift), &inode);
+        }
         
         //if already valid/exists continue to the next one
         if(inode.isvalid){
@@ -264,7 +538,7 @@ int fs_create()
     return 0;
 }
 
-// deletes the inode indicated by the inumber
+// deletes the inode indicated by the inumber. inode 0 belongs to the filesystem
 int fs_delete( int inumber )
 {
     //error check for mounted disk
@@ -272,12 +546,16 @@ int fs_delete( int inumber )
         printf("not mounted\n");
         return 0;
     }
-    // error check
-    if(inumber < 0 || inumber > fs.meta.ninodes){
+    if(inumber < 0 || inumber == META_INODE || inumber >= fs.meta.ninodes){
         printf("invalid inumber\n");
         return 0;
-    } 
+    }
+    return inode_delete(inumber);
+}
 
+// deletes any inode, inode 0 included
+static int inode_delete( int inumber )
+{
     struct fs_inode inode;
     inode_load(inumber, &inode); //load in inodes
 
@@ -287,11 +565,16 @@ int fs_delete( int inumber )
         return 0;
     }
 
+    //buffered data is thrown away without ever reaching the disk
+    dirty_drop(inumber);
+
     // remove direct blocks
     inode.isvalid = false;
     int i;
-    for( i = 0; i < POINTERS_PER_INODE; i++) {
-        fs.free_blocks[inode.direct[i]] = true; //update the bitmap
+    for( i = 0; i < fs.geo.ndirect; i++) {
+        if(inode.direct[i]) {
+            fs_release_block(inode.direct[i]); //drop a reference, skipping holes
+        }
         inode.direct[i] = 0;
         inode.size = 0;
     }
@@ -302,19 +585,20 @@ int fs_delete( int inumber )
 
         disk_read(thedisk, inode.indirect, indirect.data);
 
-        for(i = 0; i < POINTERS_PER_BLOCK; i++) {
+        for(i = 0; i < fs.geo.nindirect; i++) {
             if(indirect.pointers[i]) {
-                fs.free_blocks[indirect.pointers[i]] = true; //update the bitmap 
+                fs_release_block(indirect.pointers[i]); //drop a reference
                 indirect.pointers[i] = 0;
             }
         }
 
-        fs.free_blocks[inode.indirect] = true;
+        fs_release_block(inode.indirect);
         inode.indirect = 0;
     }
 
     inode.size = 0;
     inode_save(inumber, &inode); //save new info
+    fs_discard_flush();
     
     return 1;
 }
@@ -327,14 +611,14 @@ int fs_getsize( int inumber )
         printf("not mounted\n");
         return 0;
     }
-    struct fs_inode inode;
-    inode_load(inumber, &inode); //load in inode info
-
     //ensures inumber is valid
-    if(inumber >= fs.meta.ninodes){
+    if(inumber < 0 || inumber >= fs.meta.ninodes){
         printf("invalid inumber\n");
         return -1;
     }
+    struct fs_inode inode;
+    inode_load(inumber, &inode); //load in inode info
+
      //esnures inode is valid
     if(!inode.isvalid){
         printf("invalid inode\n");
@@ -360,7 +644,7 @@ int fs_read( int inumber, char *data, int length, int offset )
         printf("invalid inumber\n");
         return 0;
     }
-    if(fs.meta.ninodes < inumber)
+    if(inumber >= fs.meta.ninodes)
     {
         printf("invalid inumber\n");
         return 0;
@@ -375,234 +659,2422 @@ int fs_read( int inumber, char *data, int length, int offset )
     }
     
     //adjust the length based on size of the inode
-    if (length > inode.size){
-        length = inode.size - offset; //if num bytes too big, subract offset
-    }
-    if(inode.size < offset || length <= 0){
+    if(offset < 0 || offset >= inode.size || length <= 0){
         return 0;
     }
+    if(length > inode.size - offset){
+        length = inode.size - offset;
+    }
+
+    fs_blockmap map;
+    blockmap_init(&map, inumber, &inode);
 
     int bytes = 0;
-    int i;
-    //direct blocks
-    for(i = offset/BLOCK_SIZE; i < POINTERS_PER_INODE; i++) {
-        union fs_block direct;
-        disk_read(thedisk, inode.direct[i], direct.data);
-	//continues until the length read is < blocksize
-        if((length - bytes) < BLOCK_SIZE) {
-            memcpy(data + bytes, &direct.data, length - bytes);
-            bytes = length; //mark all bytes have been read
-            return bytes;
+    while(bytes < length) {
+        int nPointer = (offset + bytes) >> fs.geo.block_shift;
+        int mod = (offset + bytes) & fs.geo.block_mask;
+        int chunk = fs.geo.block_size - mod;
+        if(chunk > length - bytes){
+            chunk = length - bytes;
         }
-        else {
-	     //copies the entire block, not all byte have been read yet
-            memcpy(data + bytes, &direct.data, BLOCK_SIZE);
-            bytes = bytes + BLOCK_SIZE;
+
+        int readBlock = blockmap_get(&map, nPointer, false);
+        if(!readBlock){
+            unsigned char *buffered = dirty_block(inumber, nPointer);
+            if(buffered){
+                memcpy(data + bytes, buffered + mod, chunk);
+            } else {
+                memset(data + bytes, 0, chunk); //holes read as zero without touching the disk
+            }
+            bytes += chunk;
+            continue;
         }
+
+        union fs_block block;
+        disk_read(thedisk, readBlock, block.data);
+        memcpy(data + bytes, block.data + mod, chunk);
+        bytes += chunk;
     }
+    return bytes; //total # of bytes read
+}
 
-    uint32_t read_size = inode.size;
-    if((read_size - offset) < length){
-        length = read_size - offset;
+// copies whole blocks of an inode straight to the host file fd
+// offset and length are in bytes and must be multiples of the block size
+int fs_read_fd( int inumber, int fd, int length, int offset )
+{
+    if(!fs.disk){
+        printf("not mounted\n");
+        return 0;
+    }
+    if(inumber < 0 || inumber >= fs.meta.ninodes){
+        printf("invalid inumber\n");
+        return 0;
+    }
+    if(offset < 0 || (offset & fs.geo.block_mask) || (length & fs.geo.block_mask)){
+        printf("unaligned transfer\n");
+        return 0;
     }
 
-    // indirect blocks
-    union fs_block indirect;
-    if(inode.indirect) {            
-        uint32_t initial_block = (offset - (POINTERS_PER_INODE * BLOCK_SIZE))/ BLOCK_SIZE;
-	
-        for( i = initial_block; i < POINTERS_PER_BLOCK; i++) {
-            disk_read(thedisk, indirect.pointers[i], indirect.data);
-	    
-	    //continues until the length read is < blocksize
-            if((length - bytes) < BLOCK_SIZE) {
-                memcpy(data + bytes, &indirect.data, length - bytes);
-                bytes = length;
-                return bytes;
+    struct fs_inode inode;
+    inode_load(inumber, &inode);
+    if(!inode.isvalid){
+        printf("invalid inode\n");
+        return 0;
+    }
+
+    //only whole blocks inside the file
+    if(offset >= inode.size || length <= 0){
+        return 0;
+    }
+    if(length > inode.size - offset){
+        length = (inode.size - offset) & ~fs.geo.block_mask;
+    }
+
+    fs_blockmap map;
+    blockmap_init(&map, inumber, &inode);
+
+    int bytes = 0;
+    int nPointer = offset >> fs.geo.block_shift;
+    int last = (offset + length) >> fs.geo.block_shift;
+
+    //send each physically contiguous run in one transfer
+    while(nPointer < last) {
+        int first = blockmap_get(&map, nPointer, false);
+        if(!first){
+            //buffered blocks come from memory, holes are sent as zeros
+            static const unsigned char zeros[BLOCK_SIZE_MAX];
+            const unsigned char *source = dirty_block(inumber, nPointer);
+            if(!source){
+                source = zeros;
             }
-            else {
-		 //copies the entire block, not all byte have been read yet
-                memcpy(data + bytes, &indirect.data, BLOCK_SIZE);
-                bytes = bytes + BLOCK_SIZE;
+            int done = 0;
+            while(done < fs.geo.block_size) {
+                ssize_t actual = write(fd, source + done, fs.geo.block_size - done);
+                if(actual <= 0){
+                    return bytes + done;
+                }
+                done += actual;
             }
+            bytes += fs.geo.block_size;
+            nPointer++;
+            continue;
+        }
+        int run = 1;
+        while(nPointer + run < last && blockmap_get(&map, nPointer + run, false) == first + run){
+            run++;
+        }
+
+        int actual = disk_copyout(thedisk, first, run, fd);
+        if(actual < 0){
+            break;
         }
+        bytes += actual;
+        if(actual != run * fs.geo.block_size){
+            break;
+        }
+        nPointer += run;
     }
-    return bytes; //total # of bytes read
+    return bytes;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
+// fills whole blocks of an inode straight from the host file fd
+// offset and length are in bytes and must be multiples of the block size.
+// with deduplication on the blocks are read in and written like fs_write,
+// so that each one is matched and indexed
+int fs_write_fd( int inumber, int fd, int length, int offset )
 {
-    int bytes = 0;
-	
-     //error checks for mount
     if(!fs.disk){
         printf("not mounted\n");
         return 0;
     }
+    if(inumber < 0 || inumber == META_INODE || inumber >= fs.meta.ninodes){
+        printf("invalid inumber\n");
+        return 0;
+    }
+    if(offset < 0 || (offset & fs.geo.block_mask) || (length & fs.geo.block_mask)){
+        printf("unaligned transfer\n");
+        return 0;
+    }
+
     struct fs_inode inode;
     inode_load(inumber, &inode);
-    
-     //ensures valid inode
-    if(!inode.isvalid || offset > inode.size){
+    if(!inode.isvalid){
         printf("invalid inode\n");
         return 0;
     }
-    
-    if((length + offset) > ((POINTERS_PER_INODE * BLOCK_SIZE) + (POINTERS_PER_BLOCK * BLOCK_SIZE))) {
+
+    if((int64_t)length + offset > (int64_t)fs.geo.nlblocks << fs.geo.block_shift) {
         return 0;
     }
 
-    int writeBlock; //write blocks
-    int nPointer = offset/BLOCK_SIZE; //how many blocks we need
-    int mod = offset % BLOCK_SIZE;
-
-    // will continue to write until there is less bytes than length
-    while(length > bytes) {
-        union fs_block readBlock = {{0}}; //read block
-        int pointer = 0;
-
-        // direct blocks
-        if(nPointer < POINTERS_PER_INODE) {
-            pointer = nPointer;
-	    //write to our block
-            if(inode.direct[pointer]){
-                writeBlock = inode.direct[pointer]; 
-            } 
-            else {
-                int i;
-                int freeBlock = -1;
-                for( i = 0; i < disk_nblocks(thedisk); i++) {
-                    if(fs.free_blocks[i]) {
-                        freeBlock = i;
-                        fs.free_blocks[freeBlock] = false; //update bitmap
-                        break;
-                    }
-                }
+    //buffered blocks in the range must have disk blocks before they are overwritten
+    if(!fs_flush(inumber)){
+        return 0;
+    }
+    inode_load(inumber, &inode);
 
-                if(freeBlock == -1){
-		    break; //break out of while loop
-		}
-                writeBlock = freeBlock;
-            }
+    //don't allocate blocks past the end of a regular host file
+    struct stat info;
+    off_t position = lseek(fd, 0, SEEK_CUR);
+    if(position >= 0 && !fstat(fd, &info) && S_ISREG(info.st_mode)){
+        off_t remaining = info.st_size > position ? info.st_size - position : 0;
+        if(length > remaining){
+            length = remaining & ~(off_t)fs.geo.block_mask;
+        }
+    }
+    if(fs.dedup) {
+        return fs_write_fd_dedup(inumber, fd, length, offset);
+    }
 
-            int i;
-            for(i = mod; i < BLOCK_SIZE; i++) {
-                if(bytes >= length) {
-		    break;
-		}
-                readBlock.data[i] = data[bytes]; //put block data into char data to print to stdout
-                bytes++;
-            
-            disk_write(thedisk, writeBlock, readBlock.data); //writes data to writeblock index
+    fs_blockmap map;
+    blockmap_init(&map, inumber, &inode);
 
-            inode.direct[pointer] = writeBlock;
+    int bytes = 0;
+    int nPointer = offset >> fs.geo.block_shift;
+    int last = (offset + length) >> fs.geo.block_shift;
+
+    //fill each physically contiguous run in one transfer
+    //blocks shared with a clone are replaced by fresh ones, not overwritten
+    while(nPointer < last) {
+        if(!blockmap_unshare(&map, nPointer)){
+            break;
+        }
+        int first = blockmap_get(&map, nPointer, true);
+        if(!first){
+            break; //disk is full
+        }
+        int run = 1;
+        while(nPointer + run < last) {
+            if(!blockmap_unshare(&map, nPointer + run)){
+                break;
+            }
+            int next = blockmap_get(&map, nPointer + run, true);
+            if(next != first + run){
+                break;
             }
+            run++;
         }
 
-        // indirect blocks
-        else if(nPointer < (POINTERS_PER_BLOCK + POINTERS_PER_INODE)) {
-            int indirectNum = 0;
-
-            if(inode.indirect){
-                indirectNum = inode.indirect; //see if the inode currently has an indirect ptr
-            }
+        int actual = disk_copyin(thedisk, first, run, fd);
+        if(actual < 0){
+            break;
+        }
+        bytes += actual;
+        if(actual != run * fs.geo.block_size){
+            break;
+        }
+        nPointer += run;
+    }
 
-            else {
-                int freeBlock = -1;
-                int i;
-		//if inore doesnt have an indirect ptr currently
-                for(i = 1; i < fs.meta.nblocks; i++) {
-                    if(fs.free_blocks[i]) {
-                        freeBlock = i;
-                        fs.free_blocks[freeBlock] = false; //update bitmap
-                        break;
-                    }
-                }
+    blockmap_flush(&map);
 
-                if(freeBlock == -1){
-		    break; //break out of while loop
-		}
+    if(offset + bytes > inode.size){
+        inode.size = offset + bytes;
+    }
+    inode_save(inumber, &inode);
 
-                union fs_block zeroBlock = {{0}};      
+    return bytes;
+}
 
-                disk_write(thedisk, freeBlock, zeroBlock.data); //write data to freeblock index
+// fs_write_fd through the buffered write path, a batch of blocks at a time
+static int fs_write_fd_dedup( int inumber, int fd, int length, int offset )
+{
+    int batch = FLUSH_BATCH << fs.geo.block_shift;
+    char *buffer = malloc(batch);
+    if(!buffer){
+        printf("Malloc failed\n");
+        return 0;
+    }
 
-                indirectNum = freeBlock;
-                inode.indirect = indirectNum; //update indirect info
+    int bytes = 0;
+    while(bytes < length) {
+        int chunk = length - bytes < batch ? length - bytes : batch;
+        int got = 0;
+        while(got < chunk) {
+            ssize_t n = read(fd, buffer + got, chunk - got);
+            if(n < 0 && errno == EINTR){
+                continue;
             }
+            if(n <= 0){
+                break;
+            }
+            got += n;
+        }
+        //only whole blocks are moved, the rest is left to be read again
+        int whole = got & ~fs.geo.block_mask;
+        if(got > whole){
+            lseek(fd, whole - got, SEEK_CUR);
+        }
+        if(!whole || inode_write(inumber, buffer, whole, offset + bytes) != whole){
+            break;
+        }
+        bytes += whole;
+        if(whole < chunk){
+            break;
+        }
+    }
+    free(buffer);
 
-            union fs_block indirect;
-            disk_read(thedisk, inode.indirect, indirect.data);
+    if(!fs_flush(inumber)){
+        return 0;
+    }
+    return bytes;
+}
 
-            pointer = indirect.pointers[nPointer - POINTERS_PER_INODE]; //block num 
+// writes length bytes of data at offset. inode 0 belongs to the filesystem
+int fs_write( int inumber, const char *data, int length, int offset )
+{
+    if(!fs.disk){
+        printf("not mounted\n");
+        return 0;
+    }
+    if(inumber < 0 || inumber == META_INODE || inumber >= fs.meta.ninodes){
+        printf("invalid inumber\n");
+        return 0;
+    }
+    return inode_write(inumber, data, length, offset);
+}
 
-            if(!pointer) {
-                int freeBlock = -1;
-                int i;
-                for(i = 1; i < fs.meta.nblocks; i++) {
-                    if(fs.free_blocks[i]) {
-                        freeBlock = i;
-                        fs.free_blocks[freeBlock] = false; //update the bitmap
-                        break;
-                    }
-                }
+// writes to any inode, inode 0 included
+static int inode_write( int inumber, const char *data, int length, int offset )
+{
+    int bytes = 0;
 
-                if(freeBlock < 0) {
-                    break; //break out of while loop
-		}
+    //make room in the buffer before looking at the inode
+    if(fs.nbuffered + (length >> fs.geo.block_shift) + 2 > DELAYED_MAX_BYTES >> fs.geo.block_shift){
+        fs_sync();
+    }
 
-                writeBlock = freeBlock; //updates our write block
-            }
+    struct fs_inode inode;
+    inode_load(inumber, &inode);
+    
+     //ensures valid inode, writing past the end leaves a hole
+    if(!inode.isvalid || offset < 0){
+        printf("invalid inode\n");
+        return 0;
+    }
+    
+    if((int64_t)length + offset > (int64_t)fs.geo.nlblocks << fs.geo.block_shift) {
+        return 0;
+    }
+
+    fs_blockmap map;
+    blockmap_init(&map, inumber, &inode);
+
+    // will continue to write until there is less bytes than length
+    while(length > bytes) {
+        int nPointer = (offset + bytes) >> fs.geo.block_shift;
+        int mod = (offset + bytes) & fs.geo.block_mask;
+        int chunk = fs.geo.block_size - mod;
+        if(chunk > length - bytes){
+            chunk = length - bytes;
+        }
+
+        union fs_block block;
+        int writeBlock = blockmap_get(&map, nPointer, false);
 
-            else{
-                writeBlock = pointer; //write = indirect  
+        //data for holes is buffered, its blocks are picked at flush time
+        //a shared indirect block is copied now, flushing can't run out of room for it
+        if(!writeBlock) {
+            if(nPointer >= fs.geo.ndirect && inode.indirect && !blockmap_own_indirect(&map)){
+                break; //disk is full
             }
+            unsigned char *buffered = dirty_buffer(inumber, nPointer, inode.indirect != 0);
+            if(!buffered){
+                break; //disk is full
+            }
+            memcpy(buffered + mod, data + bytes, chunk);
+            bytes += chunk;
+            continue;
+        }
 
-            int i;
-            for(i = mod; i < BLOCK_SIZE; i++) {
-                if(bytes >= length){
-                    break;
-		}
-                readBlock.data[i] = data[bytes]; //write the data to our blocks
-                bytes++;
+        //copy on write: this file's own copy is buffered and placed at flush time
+        if(fs.refs[writeBlock] > 1) {
+            if(!blockmap_unshare(&map, nPointer)){
+                break;
             }
+            unsigned char *buffered = dirty_buffer(inumber, nPointer, inode.indirect != 0);
+            if(!buffered){
+                blockmap_set(&map, nPointer, writeBlock);
+                fs_share_block(writeBlock);
+                break; //disk is full
+            }
+            if(chunk < fs.geo.block_size){
+                disk_read(thedisk, writeBlock, buffered);
+            }
+            memcpy(buffered + mod, data + bytes, chunk);
+            bytes += chunk;
+            continue;
+        }
 
-            indirect.pointers[nPointer - POINTERS_PER_INODE] = writeBlock;
-        
-            disk_write(thedisk, writeBlock, readBlock.data); //write data to writeblock index
-            disk_write(thedisk, indirectNum, indirect.data); //write indirect data to indirectnum index
+        //keep the rest of a partially written block
+        if(chunk < fs.geo.block_size) {
+            disk_read(thedisk, writeBlock, block.data);
+        }
+
+        memcpy(block.data + mod, data + bytes, chunk);
+        bytes += chunk;
+
+        //a copy of the new contents may already be on disk
+        if(fs.dedup) {
+            int32_t match = dedup_match(&map, nPointer, block.data);
+            if(match >= 0) {
+                if(match != writeBlock) {
+                    fs_release_block(writeBlock);
+                }
+                continue;
+            }
         }
 
-        nPointer++; //increment block ptr
+        disk_write(thedisk, writeBlock, block.data); //writes data to writeblock index
+        if(fs.dedup) {
+            dedup_insert(block.data, writeBlock);
+        }
     }
 
+    blockmap_flush(&map);
+
     //set inode info
-    inode.isvalid = true;
-    inode.size = bytes + offset;
+    if(bytes > 0 && offset + bytes > inode.size){
+        inode.size = offset + bytes;
+    }
 
     inode_save(inumber, &inode); //save inode
 
     return bytes;
 }
 
-void inode_load(int inumber, struct fs_inode *inode){    
-    //printf("in inode load\n");
-    union fs_block block;
-    int blockNum = (inumber / INODES_PER_BLOCK) + 1; //plus 1 skips the super block 
-    int offset = inumber % INODES_PER_BLOCK;
+// reserves disk blocks for every hole in [offset, offset+length)
+// as one contiguous run where possible, extending the file to cover it
+int fs_fallocate( int inumber, int offset, int length )
+{
+    if(!fs.disk){
+        printf("not mounted\n");
+        return 0;
+    }
+    if(inumber < 0 || inumber == META_INODE || inumber >= fs.meta.ninodes){
+        printf("invalid inumber\n");
+        return 0;
+    }
+    if(!fs_flush(inumber)){
+        return 0; //buffered blocks are not holes
+    }
+    struct fs_inode inode;
+    inode_load(inumber, &inode);
+    if(!inode.isvalid || offset < 0 || length <= 0){
+        printf("invalid inode\n");
+        return 0;
+    }
+    if((int64_t)length + offset > (int64_t)fs.geo.nlblocks << fs.geo.block_shift) {
+        return 0;
+    }
 
-    disk_read(thedisk, blockNum, block.data);
-    *inode = block.inode[offset];
-}
+    fs_blockmap map;
+    blockmap_init(&map, inumber, &inode);
 
-void inode_save(int inumber, struct fs_inode *inode) {
+    int first = offset >> fs.geo.block_shift;
+    int last = (offset + length - 1) >> fs.geo.block_shift;
+    int i;
 
-    union fs_block block;
-    int blockNum = (inumber / INODES_PER_BLOCK) + 1;
-    int offset = inumber % INODES_PER_BLOCK;
+    //count the holes, plus the indirect block if the range needs one
+    int needed = 0;
+    for(i = first; i <= last; i++) {
+        if(!blockmap_get(&map, i, false)){
+            needed++;
+        }
+    }
+    bool needIndirect = last >= fs.geo.ndirect && !inode.indirect;
+    if(needIndirect){
+        needed++;
+    }
+    if(needed > fs.nfree - fs.reserved){
+        return 0; //would only fill the disk and fail
+    }
 
-    disk_read(thedisk, blockNum, block.data);
+    //keep the run right after the block in front of the range
+    int32_t goal = inode_goal(inumber);
+    if(first > 0 && blockmap_get(&map, first - 1, false)) {
+        goal = blockmap_get(&map, first - 1, false) + 1;
+    }
+    int32_t run = fs_allocate_free_run(goal, needed);
+    int32_t next = run;
 
-    block.inode[offset] = *inode;
-    disk_write(thedisk, blockNum, block.data);
+    if(needIndirect) {
+        int32_t indirect = run ? next++ : fs_allocate_free_block(goal);
+        if(!indirect){
+            return 0;
+        }
+        blockmap_add_indirect(&map, indirect);
+    }
+
+    //preallocated blocks must read back as zero. the run is punched out in
+    //one call as fs_format does, written in batches where that fails, and
+    //only blocks found piecewise are zeroed one at a time
+    union fs_block zeroBlock = {{0}};
+    int32_t data = needIndirect ? run + 1 : run;
+    int ndata = needed - needIndirect;
+    bool runZeroed = !run || !ndata || disk_discard(thedisk, data, ndata) == 0;
+    unsigned char *zeros = runZeroed ? 0 : calloc(FLUSH_BATCH, fs.geo.block_size);
+    if(zeros) {
+        for(i = 0; i < ndata; i += FLUSH_BATCH) {
+            disk_write_blocks(thedisk, data + i, ndata - i < FLUSH_BATCH ? ndata - i : FLUSH_BATCH, zeros);
+        }
+        free(zeros);
+        runZeroed = true;
+    }
+
+    int placed[last - first + 1]; //holes filled so far, undone on failure
+    int nplaced = 0;
+    int result = 1;
+    for(i = first; i <= last; i++) {
+        if(blockmap_get(&map, i, false)){
+            continue;
+        }
+        int32_t block = run ? next++ : 0;
+        if(!block) {
+            block = blockmap_get(&map, i, true); //no single run is free, fill piecewise
+            if(!block) {
+                result = 0;
+                break;
+            }
+            disk_write(thedisk, block, zeroBlock.data);
+        } else if(!blockmap_set(&map, i, block)) {
+            fs_release_block(block);
+            result = 0;
+            break;
+        } else if(!runZeroed) {
+            disk_write(thedisk, block, zeroBlock.data);
+        }
+        placed[nplaced++] = i;
+    }
+
+    //a failed call leaves the file as it was
+    if(!result) {
+        while(nplaced--) {
+            int32_t block = blockmap_get(&map, placed[nplaced], false);
+            blockmap_set(&map, placed[nplaced], 0);
+            fs_release_block(block);
+        }
+        while(run && next < run + needed) {
+            fs_release_block(next++);
+        }
+        if(needIndirect) {
+            fs_release_block(inode.indirect);
+            inode.indirect = 0;
+            map.dirty = false;
+        }
+        fs_discard_flush();
+    }
+
+    blockmap_flush(&map);
+
+    if(result && offset + length > inode.size){
+        inode.size = offset + length;
+    }
+    inode_save(inumber, &inode);
+
+    return result;
+}
+
+// gives disk blocks to the data buffered for one inode and writes it out,
+// placing all of it in a single run after the file's last block if possible
+int fs_flush( int inumber )
+{
+    if(!fs.disk){
+        printf("not mounted\n");
+        return 0;
+    }
+    fs_dirty *dirty = dirty_find(inumber);
+    if(!dirty){
+        return 1; //nothing buffered
+    }
+
+    struct fs_inode inode;
+    inode_load(inumber, &inode);
+
+    fs_blockmap map;
+    blockmap_init(&map, inumber, &inode);
+
+    //the reservation is used up by this allocation
+    fs.reserved -= dirty->nblocks + dirty->indirect;
+
+    int i, first = -1, kept = 0;
+    bool keptIndirect = false;
+
+    //blocks that are zero or already stored elsewhere need no space of their own
+    if(fs.dedup) {
+        for(i = 0; i < fs.geo.nlblocks; i++) {
+            if(dirty->blocks[i] && dedup_match(&map, i, dirty->blocks[i]) >= 0) {
+                free(dirty->blocks[i]);
+                dirty->blocks[i] = 0;
+                dirty->nblocks--;
+                fs.nbuffered--;
+            }
+        }
+    }
+
+    bool needIndirect = false;
+    for(i = 0; i < fs.geo.nlblocks; i++) {
+        if(!dirty->blocks[i]) {
+            continue;
+        }
+        if(first < 0) {
+            first = i;
+        }
+        if(i >= fs.geo.ndirect && !inode.indirect) {
+            needIndirect = true;
+        }
+    }
+
+    if(first < 0) {
+        first = fs.geo.nlblocks; //nothing left to place
+    }
+
+    int32_t goal = inode_goal(inumber);
+    for(i = first - 1; i >= 0; i--) {
+        int32_t previous = blockmap_get(&map, i, false);
+        if(previous) {
+            goal = previous + 1;
+            break;
+        }
+    }
+    int32_t run = fs_allocate_free_run(goal, dirty->nblocks + needIndirect);
+    int32_t next = run;
+
+    //blocks landing next to each other are staged and written with one request
+    unsigned char *stage = malloc(FLUSH_BATCH << fs.geo.block_shift);
+    int32_t staged_first = 0;
+    int staged = 0;
+
+    int result = 1;
+    for(i = first; i < fs.geo.nlblocks; i++) {
+        if(!dirty->blocks[i]) {
+            continue;
+        }
+        //the indirect block goes in front of the blocks it points to
+        if(i >= fs.geo.ndirect && !inode.indirect && run) {
+            blockmap_add_indirect(&map, next++);
+        }
+
+        int32_t block;
+        if(run) {
+            block = next++;
+            if(!blockmap_set(&map, i, block)) {
+                fs_release_block(block);
+                block = 0;
+            }
+        } else {
+            block = blockmap_get(&map, i, true); //no single run is free, place piecewise
+        }
+        if(staged && (!block || block != staged_first + staged || staged == FLUSH_BATCH)) {
+            disk_write_blocks(thedisk, staged_first, staged, stage);
+            staged = 0;
+        }
+        if(!block) {
+            //no room after all, the data stays buffered
+            result = 0;
+            kept++;
+            keptIndirect |= i >= fs.geo.ndirect;
+            continue;
+        }
+        if(!stage) {
+            disk_write(thedisk, block, dirty->blocks[i]);
+        } else {
+            if(!staged) {
+                staged_first = block;
+            }
+            memcpy(stage + (staged++ << fs.geo.block_shift), dirty->blocks[i], fs.geo.block_size);
+        }
+        if(fs.dedup) {
+            dedup_insert(dirty->blocks[i], block);
+        }
+        free(dirty->blocks[i]);
+        dirty->blocks[i] = 0;
+        fs.nbuffered--;
+    }
+    if(staged) {
+        disk_write_blocks(thedisk, staged_first, staged, stage);
+    }
+    free(stage);
+
+    blockmap_flush(&map);
+    inode_save(inumber, &inode);
+
+    //blocks that found no room keep their buffers and reservation
+    dirty->nblocks = kept;
+    dirty->indirect = keptIndirect && !inode.indirect;
+    fs.reserved += dirty->nblocks + dirty->indirect;
+    if(!kept) {
+        dirty_drop(inumber);
+    }
+    return result;
+}
+
+// flushes every inode with buffered data
+int fs_sync()
+{
+    int result = 1;
+    fs_dirty *dirty = fs.dirty;
+    while(dirty) {
+        fs_dirty *next = dirty->next; //a flushed inode leaves the list
+        if(!fs_flush(dirty->inumber)) {
+            result = 0;
+        }
+        dirty = next;
+    }
+    if(fs.shared_changed && (fs.meta.features & FS_SHARED_MAP)) {
+        meta_save();
+    }
+    fs_discard_flush();
+    return result;
+}
+
+// lists the disk blocks of an inode in the order the allocator lays them out:
+// direct blocks, the indirect block, then the blocks it points to
+// indirect receives the indirect block's contents. returns the count
+static int inode_layout(struct fs_inode *inode, union fs_block *indirect, int32_t *blocks) {
+    int i, n = 0;
+    for(i = 0; i < fs.geo.ndirect; i++) {
+        if(inode->direct[i]) {
+            blocks[n++] = inode->direct[i];
+        }
+    }
+    if(inode->indirect) {
+        blocks[n++] = inode->indirect;
+        disk_read(thedisk, inode->indirect, indirect->data);
+        for(i = 0; i < fs.geo.nindirect; i++) {
+            if(indirect->pointers[i]) {
+                blocks[n++] = indirect->pointers[i];
+            }
+        }
+    }
+    return n;
+}
+
+// counts the places where a file's next block does not follow its previous one,
+// out of the pairs of neighbouring blocks, over every file
+static void fs_fragmentation(int *breaks, int *pairs) {
+    int32_t blocks[fs.geo.nlblocks + 1];
+    union fs_block indirect;
+    int i, k;
+    *breaks = 0;
+    *pairs = 0;
+    for(i = 1; i < inode_count(); i++) {
+        struct fs_inode inode;
+        inode_load(i, &inode);
+        if(!inode.isvalid) {
+            continue;
+        }
+        int n = inode_layout(&inode, &indirect, blocks);
+        for(k = 1; k < n; k++) {
+            if(blocks[k] != blocks[k - 1] + 1) {
+                (*breaks)++;
+            }
+        }
+        if(n > 1) {
+            *pairs += n - 1;
+        }
+    }
+}
+
+// moves every block of inumber into the run starting at run, in layout order
+// new copies are written and the inode saved before the old blocks are freed
+static void inode_relocate(int inumber, struct fs_inode *inode, union fs_block *indirect, int32_t *blocks, int n, int32_t run) {
+    union fs_block block;
+    int i, k = 0;
+
+    for(i = 0; i < n; i++) {
+        if(blocks[i] != inode->indirect) {
+            disk_read(thedisk, blocks[i], block.data);
+            disk_write(thedisk, run + i, block.data);
+        }
+    }
+
+    for(i = 0; i < fs.geo.ndirect; i++) {
+        if(inode->direct[i]) {
+            inode->direct[i] = run + k++;
+        }
+    }
+    if(inode->indirect) {
+        inode->indirect = run + k++;
+        for(i = 0; i < fs.geo.nindirect; i++) {
+            if(indirect->pointers[i]) {
+                indirect->pointers[i] = run + k++;
+            }
+        }
+        disk_write(thedisk, inode->indirect, indirect->data);
+    }
+    inode_save(inumber, inode);
+
+    for(i = 0; i < n; i++) {
+        fs_release_block(blocks[i]);
+    }
+}
+
+// orders inodes by where their first block sits on disk
+static int32_t *defrag_start;
+static int defrag_compare(const void *a, const void *b) {
+    return defrag_start[*(const int *)a] - defrag_start[*(const int *)b];
+}
+
+// rewrites each fragmented file into one contiguous run. with compact set,
+// files are also moved into the lowest free run that holds them, pushing
+// free space toward the end of the disk. rate limits the blocks moved per
+// second (0 for no limit). reports fragmentation before and after
+int fs_defrag( int compact, int rate )
+{
+    if(!fs.disk){
+        printf("not mounted\n");
+        return 0;
+    }
+    fs_sync(); //buffered data has no blocks to move yet
+
+    int breaks, pairs;
+    fs_fragmentation(&breaks, &pairs);
+    printf("fragmentation before: %d%% (%d of %d block pairs split)\n", pairs ? breaks * 100 / pairs : 0, breaks, pairs);
+
+    //work from the front of the disk so compaction fills the lowest holes first
+    int *order = malloc((inode_count() + 1) * sizeof(int));
+    defrag_start = malloc((inode_count() + 1) * sizeof(int32_t));
+    if(!order || !defrag_start){
+        printf("Malloc failed\n");
+        free(order);
+        free(defrag_start);
+        return 0;
+    }
+
+    int32_t blocks[fs.geo.nlblocks + 1];
+    union fs_block indirect;
+    int i, k, nfiles = 0;
+    for(i = 1; i < inode_count(); i++) {
+        struct fs_inode inode;
+        inode_load(i, &inode);
+        if(inode.isvalid && inode_layout(&inode, &indirect, blocks)) {
+            defrag_start[i] = blocks[0];
+            order[nfiles++] = i;
+        }
+    }
+    qsort(order, nfiles, sizeof(int), defrag_compare);
+
+    struct timespec begin, now;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    long moved = 0;
+    int nmoved = 0, nskipped = 0, pass;
+
+    //files that found no room get a second try once the others have moved
+    for(pass = 0; pass < 2 && nfiles; pass++) {
+        int count = nfiles;
+        nfiles = 0;
+        nskipped = 0;
+        for(i = 0; i < count; i++) {
+            int inumber = order[i];
+            struct fs_inode inode;
+            inode_load(inumber, &inode);
+            int n = inode_layout(&inode, &indirect, blocks);
+
+            int32_t lowest = blocks[0];
+            bool fragmented = false, shared = false;
+            for(k = 0; k < n; k++) {
+                if(k && blocks[k] != blocks[k - 1] + 1) {
+                    fragmented = true;
+                }
+                if(blocks[k] < lowest) {
+                    lowest = blocks[k];
+                }
+                if(fs.refs[blocks[k]] > 1) {
+                    shared = true;
+                }
+            }
+            //moving blocks shared with a clone would only duplicate them
+            if(shared || (!fragmented && !compact)) {
+                continue;
+            }
+
+            int32_t run = fs_allocate_free_run(compact ? fs.meta.ninodeblocks + 1 : blocks[0], n);
+            if(!run) {
+                order[nfiles++] = inumber; //no free run big enough
+                nskipped++;
+                continue;
+            }
+            if(!fragmented && run > lowest) {
+                int32_t b;
+                for(b = run; b < run + n; b++) {
+                    fs_release_block(b); //already in place
+                }
+                continue;
+            }
+
+            inode_relocate(inumber, &inode, &indirect, blocks, n, run);
+            nmoved++;
+            moved += n;
+
+            //throttle: sleep until the average rate is back under the limit
+            if(rate > 0) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                double elapsed = (now.tv_sec - begin.tv_sec) + (now.tv_nsec - begin.tv_nsec) / 1e9;
+                double wait = (double)moved / rate - elapsed;
+                if(wait > 0) {
+                    struct timespec pause = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+                    nanosleep(&pause, 0);
+                }
+            }
+        }
+    }
+    free(order);
+    free(defrag_start);
+    defrag_start = 0;
+    fs_discard_flush();
+
+    printf("moved %d files (%ld blocks), %d could not be moved\n", nmoved, moved, nskipped);
+    fs_fragmentation(&breaks, &pairs);
+    printf("fragmentation after: %d%% (%d of %d block pairs split)\n", pairs ? breaks * 100 / pairs : 0, breaks, pairs);
+    return 1;
+}
+
+// shared by the threads of one fs_check pass
+static struct {
+    fs_superblock meta;
+    uint32_t *refs; //references to each block
+    bool *inode_blocks; //blocks holding inodes or the inode map, with an inode map
+    int *damaged; //inodes with out of range pointers or a bad size
+    int ndamaged;
+} check;
+
+struct check_range {
+    int first, last; //inode blocks [first, last), by position in the table or map
+};
+
+struct check_indirect {
+    int32_t block;
+    int slot; //inode within the batch
+};
+
+static int check_compare(const void *a, const void *b) {
+    return ((const struct check_indirect *)a)->block - ((const struct check_indirect *)b)->block;
+}
+
+static bool check_valid(int32_t block) {
+    return block > check.meta.ninodeblocks && block < check.meta.nblocks
+        && !(check.inode_blocks && check.inode_blocks[block]);
+}
+
+// counts the blocks used by the inodes in a range of inode blocks,
+// reading inode blocks and then their indirect blocks in batches
+static void *check_scan(void *arg) {
+    struct check_range *range = arg;
+    int ninodes = FSCK_BATCH << fs.geo.inodes_shift;
+    unsigned char *batch = malloc(FSCK_BATCH << fs.geo.block_shift);
+    unsigned char *pointers = malloc(FSCK_BATCH << fs.geo.block_shift);
+    struct fs_inode *inodes = malloc(ninodes * sizeof(*inodes));
+    struct check_indirect *indirects = malloc(ninodes * sizeof(*indirects));
+    int *highest = malloc(ninodes * sizeof(int));
+    bool *bad = malloc(ninodes * sizeof(bool));
+    if(!batch || !pointers || !inodes || !indirects || !highest || !bad) {
+        printf("Malloc failed\n");
+        free(batch); free(pointers); free(inodes); free(indirects); free(highest); free(bad);
+        return (void *)1;
+    }
+
+    int b, i, j, k;
+    for(b = range->first; b < range->last; b += FSCK_BATCH) {
+        int n = range->last - b < FSCK_BATCH ? range->last - b : FSCK_BATCH;
+        int nindirect = 0;
+        ninodes = n << fs.geo.inodes_shift;
+
+        //inode blocks that follow each other on disk come in with one read
+        for(i = 0; i < n; i = j) {
+            for(j = i + 1; j < n && inode_block(b + j) == inode_block(b + i) + (j - i); j++);
+            disk_read_blocks(thedisk, inode_block(b + i), j - i, batch + (i << fs.geo.block_shift));
+        }
+        //with an inode map they are data area blocks referenced by the map
+        for(i = 0; fs.imap && i < n; i++) {
+            __atomic_add_fetch(&check.refs[inode_block(b + i)], 1, __ATOMIC_RELAXED);
+        }
+
+        for(i = 0; i < ninodes; i++) {
+            struct fs_inode *inode = &inodes[i];
+            inode_unpack(batch + (i << fs.geo.inode_shift), inode);
+            highest[i] = -1;
+            bad[i] = false;
+            if(!inode->isvalid) {
+                continue;
+            }
+            for(j = 0; j < fs.geo.ndirect; j++) {
+                if(!inode->direct[j]) {
+                    continue;
+                }
+                if(!check_valid(inode->direct[j])) {
+                    bad[i] = true;
+                    continue;
+                }
+                __atomic_add_fetch(&check.refs[inode->direct[j]], 1, __ATOMIC_RELAXED);
+                highest[i] = j;
+            }
+            if(inode->indirect) {
+                if(!check_valid(inode->indirect)) {
+                    bad[i] = true;
+                } else {
+                    __atomic_add_fetch(&check.refs[inode->indirect], 1, __ATOMIC_RELAXED);
+                    indirects[nindirect].block = inode->indirect;
+                    indirects[nindirect].slot = i;
+                    nindirect++;
+                }
+            }
+        }
+
+        //fetch neighbouring indirect blocks with one read
+        qsort(indirects, nindirect, sizeof(*indirects), check_compare);
+        for(i = 0; i < nindirect; i = j) {
+            int32_t base = indirects[i].block;
+            for(j = i + 1; j < nindirect; j++) {
+                int32_t gap = indirects[j].block - indirects[j - 1].block;
+                if(gap > 1 || indirects[j].block - base >= FSCK_BATCH) {
+                    break;
+                }
+            }
+            disk_read_blocks(thedisk, base, indirects[j - 1].block - base + 1, pointers);
+
+            for(k = i; k < j; k++) {
+                int slot = indirects[k].slot;
+                int *table = (int *)(pointers + ((indirects[k].block - base) << fs.geo.block_shift));
+                int p;
+                for(p = 0; p < fs.geo.nindirect; p++) {
+                    if(!table[p]) {
+                        continue;
+                    }
+                    if(!check_valid(table[p])) {
+                        bad[slot] = true;
+                        continue;
+                    }
+                    __atomic_add_fetch(&check.refs[table[p]], 1, __ATOMIC_RELAXED);
+                    highest[slot] = fs.geo.ndirect + p;
+                }
+            }
+        }
+
+        //the size has to reach into the last allocated block
+        for(i = 0; i < ninodes; i++) {
+            struct fs_inode *inode = &inodes[i];
+            if(!inode->isvalid) {
+                continue;
+            }
+            int64_t limit = (int64_t)fs.geo.nlblocks << fs.geo.block_shift;
+            if(inode->size < 0 || inode->size > limit || (int64_t)inode->size <= (int64_t)highest[i] << fs.geo.block_shift) {
+                bad[i] = true;
+            }
+            if(bad[i]) {
+                int at = __atomic_fetch_add(&check.ndamaged, 1, __ATOMIC_RELAXED);
+                check.damaged[at] = (b << fs.geo.inodes_shift) + i;
+            }
+        }
+    }
+
+    free(batch); free(pointers); free(inodes); free(indirects); free(highest); free(bad);
+    return 0;
+}
+
+static int check_compare_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// a block no inode references, for giving a cross-linked block its own copy
+static int32_t check_spare(int32_t *cursor) {
+    for(; *cursor < check.meta.nblocks; (*cursor)++) {
+        if(!check.refs[*cursor]) {
+            check.refs[*cursor] = 1;
+            return (*cursor)++;
+        }
+    }
+    return 0;
+}
+
+// resolves one pointer: drops it if out of range, and gives it its own copy
+// of a block once more inodes claim the block than the shared block map
+// allows (dropping it if the disk is full). claimed is null when no block
+// is claimed too often. returns the number of problems found
+static int check_pointer(int inumber, int32_t *pointer, uint32_t *claimed, const uint32_t *expected, int32_t *cursor, bool repair, bool *changed) {
+    if(!*pointer) {
+        return 0;
+    }
+    if(!check_valid(*pointer)) {
+        printf("inode %d: block %d is outside the data area or holds inodes\n", inumber, *pointer);
+        if(repair) {
+            *pointer = 0;
+            *changed = true;
+        }
+        return 1;
+    }
+    if(!claimed || ++claimed[*pointer] <= 1 || claimed[*pointer] <= expected[*pointer]) {
+        return 0;
+    }
+    printf("inode %d: block %d is also used by another inode\n", inumber, *pointer);
+    if(repair) {
+        int32_t copy = check_spare(cursor);
+        if(copy) {
+            union fs_block block;
+            disk_read(thedisk, *pointer, block.data);
+            disk_write(thedisk, copy, block.data);
+        }
+        check.refs[*pointer]--;
+        *pointer = copy;
+        *changed = true;
+    }
+    return 1;
+}
+
+// checks the filesystem on thedisk: every block pointer must lie in the
+// data area, no block may have more pointers than the shared block map
+// allows, and a file's size must reach its last block. inode and indirect
+// blocks are scanned by several threads with batched reads, counting the
+// references to every block. with repair set, bad pointers are cleared,
+// cross-linked blocks are copied and sizes raised. if mounted, the reference
+// counts and free block map are checked against what is actually referenced
+// and rebuilt.
+// returns 1 if the filesystem is (now) consistent, 0 if not
+int fs_check( int repair )
+{
+    union fs_block block;
+    disk_read(thedisk, 0, block.data);
+    if(block.super.magic != FS_MAGIC || (!fs.disk && !geometry_load(&block.super))) {
+        printf("superblock is not valid\n");
+        return 0;
+    }
+    int nblocks = disk_nblocks(thedisk);
+    if(block.super.nblocks != nblocks || block.super.ninodeblocks < 0 || block.super.ninodeblocks >= nblocks
+       || (block.super.ninodeblocks && block.super.ninodes != block.super.ninodeblocks << fs.geo.inodes_shift)
+       || (!fs.disk && !imap_load(&block))) {
+        printf("superblock is not valid\n");
+        return 0;
+    }
+    if(fs.disk) {
+        fs_sync(); //check what is really on disk
+    }
+
+    check.meta = block.super;
+    check.refs = calloc(nblocks, sizeof(uint32_t));
+    int i;
+    check.damaged = malloc((inode_count() + 1) * sizeof(int));
+    check.inode_blocks = fs.imap ? calloc(nblocks, sizeof(bool)) : 0;
+    check.ndamaged = 0;
+    if(!check.refs || !check.damaged || (fs.imap && !check.inode_blocks)) {
+        printf("Calloc failed\n");
+        free(check.refs);
+        free(check.damaged);
+        free(check.inode_blocks);
+        return 0;
+    }
+    //pointers into the inode map are as bad as pointers off the disk
+    for(i = 0; fs.imap && i < fs.nimap; i++) {
+        check.inode_blocks[fs.imap[i]] = true;
+    }
+    for(i = 0; i < fs.nimap_chain; i++) {
+        check.inode_blocks[fs.imap_chain[i]] = true;
+        check.refs[fs.imap_chain[i]]++;
+    }
+
+    //split the inode blocks between the threads
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu < 1 ? 1 : (ncpu > FSCK_MAX_THREADS ? FSCK_MAX_THREADS : ncpu);
+    if(nthreads > fs.nimap) {
+        nthreads = fs.nimap;
+    }
+    pthread_t threads[FSCK_MAX_THREADS];
+    struct check_range ranges[FSCK_MAX_THREADS];
+    int t, started = 0;
+    bool failed = false;
+    for(t = 0; t < nthreads; t++) {
+        ranges[t].first = (int64_t)fs.nimap * t / nthreads;
+        ranges[t].last = (int64_t)fs.nimap * (t + 1) / nthreads;
+        if(pthread_create(&threads[t], 0, check_scan, &ranges[t])) {
+            if(check_scan(&ranges[t])) {
+                failed = true; //scan this range here instead
+            }
+            continue;
+        }
+        started |= 1 << t;
+    }
+    for(t = 0; t < nthreads; t++) {
+        void *result = 0;
+        if(started & (1 << t)) {
+            pthread_join(threads[t], &result);
+        }
+        if(result) {
+            failed = true;
+        }
+    }
+    if(failed) {
+        free(check.refs);
+        free(check.damaged);
+        free(check.inode_blocks);
+        return 0;
+    }
+
+    int problems = 0;
+
+    //blocks with more pointers than the shared block map allows are cross-linked
+    uint32_t *expected = shared_load();
+    int crosslinked = 0;
+    for(i = check.meta.ninodeblocks + 1; expected && i < nblocks; i++) {
+        if(check.refs[i] > 1 && check.refs[i] > expected[i]) {
+            crosslinked++;
+        }
+    }
+    uint32_t *claimed = crosslinked ? calloc(nblocks, sizeof(uint32_t)) : 0;
+    int32_t cursor = check.meta.ninodeblocks + 1;
+    if(crosslinked && !claimed) {
+        printf("Calloc failed\n");
+        free(expected);
+        free(check.refs);
+        free(check.damaged);
+        free(check.inode_blocks);
+        return 0;
+    }
+
+    //fix up the few inodes that need it one at a time, in inode order.
+    //finding who else claims a cross-linked block takes every inode
+    qsort(check.damaged, check.ndamaged, sizeof(int), check_compare_int);
+
+    int next, count = crosslinked ? inode_count() : check.ndamaged;
+    for(next = 0; next < count; next++) {
+        i = crosslinked ? next : check.damaged[next];
+        struct fs_inode inode;
+        inode_load(i, &inode);
+        if(!inode.isvalid) {
+            continue;
+        }
+
+        union fs_block indirect;
+        bool changed = false, indirectChanged = false;
+        int j, highest = -1;
+        for(j = 0; j < fs.geo.ndirect; j++) {
+            problems += check_pointer(i, &inode.direct[j], claimed, expected, &cursor, repair, &changed);
+            if(inode.direct[j]) {
+                highest = j;
+            }
+        }
+        problems += check_pointer(i, &inode.indirect, claimed, expected, &cursor, repair, &changed);
+        if(inode.indirect && check_valid(inode.indirect)) {
+            disk_read(thedisk, inode.indirect, indirect.data);
+            for(j = 0; j < fs.geo.nindirect; j++) {
+                problems += check_pointer(i, &indirect.pointers[j], claimed, expected, &cursor, repair, &indirectChanged);
+                if(indirect.pointers[j]) {
+                    highest = fs.geo.ndirect + j;
+                }
+            }
+            if(indirectChanged) {
+                disk_write(thedisk, inode.indirect, indirect.data);
+            }
+        }
+
+        int64_t limit = (int64_t)fs.geo.nlblocks << fs.geo.block_shift;
+        if(inode.size < 0 || inode.size > limit || (int64_t)inode.size <= (int64_t)highest << fs.geo.block_shift) {
+            printf("inode %d: size %d does not match its blocks\n", i, inode.size);
+            problems++;
+            if(repair) {
+                inode.size = (highest + 1) << fs.geo.block_shift;
+                changed = true;
+            }
+        }
+        if(changed) {
+            inode_save(i, &inode);
+        }
+    }
+    free(claimed);
+    free(expected);
+
+    //compare the reference counts of the mounted filesystem
+    if(fs.disk) {
+        int leaked = 0, lost = 0, miscounted = 0;
+        for(i = check.meta.ninodeblocks + 1; i < nblocks; i++) {
+            if(fs.free_blocks[i] && check.refs[i]) {
+                lost++; //in use but would be handed out again
+            } else if(!fs.free_blocks[i] && !check.refs[i]) {
+                leaked++; //unused but never handed out
+            } else if(fs.refs[i] != check.refs[i]) {
+                miscounted++; //would be freed too early or never
+            }
+        }
+        if(lost || leaked || miscounted) {
+            printf("free block map: %d used blocks marked free, %d unused blocks marked used, %d wrong reference counts\n", lost, leaked, miscounted);
+            problems += lost + leaked + miscounted;
+        }
+        if(repair) {
+            int g;
+            for(g = 0; g < fs.ngroups; g++) {
+                fs.group_free[g] = 0;
+            }
+            fs.nfree = 0;
+            for(i = 0; i < nblocks; i++) {
+                fs.free_blocks[i] = i > check.meta.ninodeblocks && !check.refs[i];
+                fs.refs[i] = check.refs[i];
+                if(fs.free_blocks[i]) {
+                    fs.group_free[i / BLOCKS_PER_GROUP]++;
+                    fs.nfree++;
+                }
+            }
+            shared_change();
+        }
+    }
+
+    int used = 0, shared = 0;
+    for(i = check.meta.ninodeblocks + 1; i < nblocks; i++) {
+        if(check.refs[i]) {
+            used++;
+        }
+        if(check.refs[i] > 1) {
+            shared++;
+        }
+    }
+    printf("checked %d inode blocks with %d threads: %d data blocks in use (%d shared), %d problems%s\n",
+        fs.nimap, nthreads, used, shared, problems, problems && repair ? " repaired" : "");
+
+    free(check.refs);
+    free(check.damaged);
+    free(check.inode_blocks);
+    check.refs = 0;
+    check.damaged = 0;
+    check.inode_blocks = 0;
+    return !problems || repair;
+}
+
+// creates a new inode sharing every block of inumber. nothing is copied
+// until one of the two files writes a shared block and gets its own copy
+// returns the new inumber, 0 on failure
+int fs_clone( int inumber )
+{
+    if(!fs.disk){
+        printf("not mounted\n");
+        return 0;
+    }
+    if(inumber < 0 || inumber == META_INODE || inumber >= fs.meta.ninodes){
+        printf("invalid inumber\n");
+        return 0;
+    }
+    if(!fs_flush(inumber)){
+        return 0; //buffered data has to be on disk to be shared
+    }
+
+    struct fs_inode inode;
+    inode_load(inumber, &inode);
+    if(!inode.isvalid){
+        printf("invalid inode\n");
+        return 0;
+    }
+
+    int clone = fs_create();
+    if(!clone){
+        return 0;
+    }
+
+    int i;
+    for(i = 0; i < fs.geo.ndirect; i++) {
+        fs_share_block(inode.direct[i]);
+    }
+    if(inode.indirect) {
+        union fs_block indirect;
+        disk_read(thedisk, inode.indirect, indirect.data);
+        fs_share_block(inode.indirect);
+        for(i = 0; i < fs.geo.nindirect; i++) {
+            fs_share_block(indirect.pointers[i]);
+        }
+    }
+
+    inode.ctime = time(0);
+    inode_save(clone, &inode);
+    return clone;
+}
+
+// clones every file, so the clones keep the filesystem as it is now.
+// the first max files are stored in clones with their clones, as pairs of
+// inumbers: file then clone. returns the number cloned, -1 on failure
+int fs_snapshot( int *clones, int max )
+{
+    if(!fs.disk){
+        printf("not mounted\n");
+        return -1;
+    }
+    fs_sync();
+
+    //only the files that exist now, not the clones made along the way
+    int *files = malloc((inode_count() + 1) * sizeof(int));
+    if(!files){
+        printf("Malloc failed\n");
+        return -1;
+    }
+    int i, nfiles = 0;
+    for(i = 1; i < inode_count(); i++) {
+        struct fs_inode inode;
+        inode_load(i, &inode);
+        if(inode.isvalid) {
+            files[nfiles++] = i;
+        }
+    }
+
+    for(i = 0; i < nfiles; i++) {
+        int clone = fs_clone(files[i]);
+        if(!clone) {
+            free(files);
+            return -1;
+        }
+        if(clones && i < max) {
+            clones[2 * i] = files[i];
+            clones[2 * i + 1] = clone;
+        }
+    }
+    free(files);
+    return nfiles;
+}
+
+// turns inline deduplication on or off. while on, every block written is
+// looked up by content and shared with an identical block already on disk,
+// and all-zero blocks become holes
+int fs_dedup( int enable )
+{
+    if(!fs.disk){
+        printf("not mounted\n");
+        return 0;
+    }
+    if(enable && !fs.index) {
+        fs.index_size = 1024;
+        while(fs.index_size < 2 * fs.meta.nblocks) {
+            fs.index_size *= 2;
+        }
+        fs.index = calloc(fs.index_size, sizeof(fs_dedup_entry));
+        fs.index_count = 0;
+        if(!fs.index) {
+            printf("Calloc failed\n");
+            return 0;
+        }
+    }
+    fs.dedup = enable;
+    return 1;
+}
+
+// writes out buffered data and the dedup index, then forgets the mounted
+// filesystem. does nothing if none is mounted
+int fs_unmount()
+{
+    if(!fs.disk){
+        return 0;
+    }
+    int result = fs_sync();
+    if(fs.index) {
+        meta_save();
+    }
+    fs_forget();
+    return result;
+}
+
+// drops everything kept in memory for the mounted filesystem
+// data the full disk had no room for is lost
+static void fs_forget() {
+    while(fs.dirty) {
+        dirty_drop(fs.dirty->inumber);
+    }
+    free(fs.free_blocks);
+    free(fs.refs);
+    free(fs.group_free);
+    free(fs.index);
+    free(fs.imap);
+    free(fs.imap_chain);
+    free(fs.inode_blocks);
+    memset(&fs, 0, sizeof(fs));
+}
+
+// converts between an inode as stored in an inode block and in memory
+static void inode_unpack(const unsigned char *slot, struct fs_inode *inode) {
+    int ndirect = fs.geo.ndirect;
+    memset(inode, 0, sizeof(*inode));
+    memcpy(inode, slot, 16 + 4 * ndirect);
+    memcpy(&inode->indirect, slot + 16 + 4 * ndirect, 4);
+}
+
+static void inode_pack(unsigned char *slot, const struct fs_inode *inode) {
+    int ndirect = fs.geo.ndirect;
+    memset(slot, 0, 1 << fs.geo.inode_shift);
+    memcpy(slot, inode, 16 + 4 * ndirect);
+    memcpy(slot + 16 + 4 * ndirect, &inode->indirect, 4);
+}
+
+void inode_load(int inumber, struct fs_inode *inode){    
+    //printf("in inode load\n");
+    union fs_block block;
+    int blockNum = inode_block(inumber >> fs.geo.inodes_shift);
+    int offset = (inumber & ((1 << fs.geo.inodes_shift) - 1)) << fs.geo.inode_shift;
+
+    //inodes past the end of the map have never been used
+    if(!blockNum) {
+        memset(inode, 0, sizeof(*inode));
+        return;
+    }
+    disk_read(thedisk, blockNum, block.data);
+    inode_unpack(block.data + offset, inode);
+}
+
+void inode_save(int inumber, struct fs_inode *inode) {
+
+    union fs_block block;
+    int blockNum = inode_block(inumber >> fs.geo.inodes_shift);
+    int offset = (inumber & ((1 << fs.geo.inodes_shift) - 1)) << fs.geo.inode_shift;
+
+    while(!blockNum) {
+        if(!inode->isvalid || !inode_block_add()) {
+            return; //an unused inode stays unused
+        }
+        blockNum = inode_block(inumber >> fs.geo.inodes_shift);
+    }
+    disk_read(thedisk, blockNum, block.data);
+
+    inode_pack(block.data + offset, inode);
+    disk_write(thedisk, blockNum, block.data);
+}
+
+// disk block holding the inode block at position index, 0 if there is none
+static int32_t inode_block(int index) {
+    if(index < 0 || index >= fs.nimap) {
+        return 0;
+    }
+    return fs.imap ? fs.imap[index] : index + 1; //plus 1 skips the super block
+}
+
+// inode slots in the inode blocks that exist
+static int inode_count() {
+    return fs.nimap << fs.geo.inodes_shift;
+}
+
+// makes the inode table or map described by sblock the current one,
+// following the map into its map blocks
+static bool imap_load(const union fs_block *sblock) {
+    const fs_superblock *super = &sblock->super;
+    free(fs.imap);
+    free(fs.imap_chain);
+    fs.imap = 0;
+    fs.imap_size = 0;
+    fs.imap_chain = 0;
+    fs.nimap_chain = 0;
+    fs.nimap = super->ninodeblocks;
+    if(super->ninodeblocks) {
+        return true;
+    }
+
+    int first = imap_first(), per = fs.geo.nindirect - 1;
+    if(super->ninodes != imap_limit(super->nblocks) || super->ninodemap < 0 || super->ninodemap >= super->nblocks) {
+        return false;
+    }
+    int nchain = super->ninodemap > first ? (super->ninodemap - first + per - 1) / per : 0;
+    if(!nchain != !super->imapnext) {
+        return false;
+    }
+    fs.imap_size = super->ninodemap > first ? super->ninodemap : first;
+    fs.imap = malloc(fs.imap_size * sizeof(int32_t));
+    fs.imap_chain = malloc((nchain ? nchain : 1) * sizeof(int32_t));
+    if(!fs.imap || !fs.imap_chain) {
+        free(fs.imap);
+        free(fs.imap_chain);
+        fs.imap = 0;
+        fs.imap_chain = 0;
+        return false;
+    }
+
+    int n = super->ninodemap < first ? super->ninodemap : first;
+    memcpy(fs.imap, sblock->data + sizeof(fs_superblock), n * sizeof(int32_t));
+    int32_t next = super->imapnext;
+    while(fs.nimap_chain < nchain) {
+        if(next < 1 || next >= super->nblocks) {
+            return false;
+        }
+        union fs_block block;
+        disk_read(thedisk, next, block.data);
+        int count = super->ninodemap - n < per ? super->ninodemap - n : per;
+        memcpy(fs.imap + n, block.pointers + 1, count * sizeof(int32_t));
+        n += count;
+        fs.imap_chain[fs.nimap_chain++] = next;
+        next = block.pointers[0];
+    }
+    if(next) {
+        return false; //the last map block leads nowhere
+    }
+    int i;
+    for(i = 0; i < super->ninodemap; i++) {
+        if(fs.imap[i] < 1 || fs.imap[i] >= super->nblocks) {
+            return false;
+        }
+    }
+    fs.nimap = super->ninodemap;
+    return true;
+}
+
+// the most inodes an inode map can list on a disk of nblocks
+static int32_t imap_limit(int32_t nblocks) {
+    int64_t limit = (int64_t)(nblocks - 1) << fs.geo.inodes_shift;
+    return limit > INT32_MAX ? INT32_MAX : limit;
+}
+
+// inode map entries held by block 0, after the superblock
+static int imap_first() {
+    return (fs.geo.block_size - sizeof(fs_superblock)) / sizeof(int32_t);
+}
+
+// writes map block c: the next map block, then its share of the map
+static void imap_chain_save(int c) {
+    union fs_block block = {{0}};
+    int per = fs.geo.nindirect - 1;
+    int start = imap_first() + c * per;
+    int count = fs.nimap - start < per ? fs.nimap - start : per;
+    block.pointers[0] = c + 1 < fs.nimap_chain ? fs.imap_chain[c + 1] : 0;
+    memcpy(block.pointers + 1, fs.imap + start, count * sizeof(int32_t));
+    disk_write(thedisk, fs.imap_chain[c], block.data);
+}
+
+// takes a zeroed block from the data area for the next inode block and
+// records it in the inode map, chaining on a map block when the map is full.
+// returns the block, 0 if there is no room
+static int32_t inode_block_add() {
+    if(!fs.disk || !fs.imap || (int64_t)(fs.nimap + 1) << fs.geo.inodes_shift > fs.meta.ninodes) {
+        return 0;
+    }
+    int first = imap_first(), per = fs.geo.nindirect - 1;
+    bool chain = fs.nimap >= first && (fs.nimap - first) % per == 0;
+    if(fs.nimap == fs.imap_size) {
+        int32_t *imap = realloc(fs.imap, 2 * fs.imap_size * sizeof(int32_t));
+        if(!imap) {
+            return 0;
+        }
+        fs.imap = imap;
+        fs.imap_size *= 2;
+    }
+    if(chain) {
+        int32_t *imap_chain = realloc(fs.imap_chain, (fs.nimap_chain + 1) * sizeof(int32_t));
+        if(!imap_chain) {
+            return 0;
+        }
+        fs.imap_chain = imap_chain;
+    }
+
+    int32_t goal = fs.nimap ? fs.imap[fs.nimap - 1] + 1 : 1;
+    int32_t link = chain ? fs_allocate_free_block(goal) : 0;
+    int32_t block = chain && !link ? 0 : fs_allocate_free_block(link ? link + 1 : goal);
+    if(!block) {
+        fs_release_block(link);
+        return 0;
+    }
+    fs.inode_blocks[block] = true;
+
+    union fs_block zero = {{0}};
+    disk_write(thedisk, block, zero.data);
+
+    fs.imap[fs.nimap++] = block;
+    fs.meta.ninodemap = fs.nimap;
+    if(link) {
+        fs.inode_blocks[link] = true;
+        fs.imap_chain[fs.nimap_chain++] = link;
+    }
+    //the new map block is written before anything leads to it
+    if(fs.nimap > first) {
+        imap_chain_save(fs.nimap_chain - 1);
+    }
+    if(link && fs.nimap_chain > 1) {
+        imap_chain_save(fs.nimap_chain - 2);
+    } else if(link) {
+        fs.meta.imapnext = link;
+    }
+    super_save();
+    return block;
+}
+
+// writes the superblock of the mounted filesystem, with the part of the
+// inode map that block 0 holds
+static void super_save() {
+    union fs_block sblock = {{0}};
+    sblock.super = fs.meta;
+    if(fs.imap) {
+        int n = fs.nimap < imap_first() ? fs.nimap : imap_first();
+        memcpy(sblock.data + sizeof(fs_superblock), fs.imap, n * sizeof(int32_t));
+    }
+    disk_write(thedisk, 0, sblock.data);
+}
+
+// checks the geometry recorded in super and makes it the current one,
+// switching thedisk to its block size. older images record none and get
+// the original layout
+static bool geometry_load(const fs_superblock *super) {
+    int block_size = super->block_size ? super->block_size : BLOCK_SIZE;
+    int ndirect = super->ndirect ? super->ndirect : POINTERS_PER_INODE;
+    int inode_size = super->inode_size ? super->inode_size : 32;
+    if(block_size < BLOCK_SIZE || block_size > BLOCK_SIZE_MAX || (block_size & (block_size - 1))) {
+        return false;
+    }
+    if(ndirect < 1 || ndirect > POINTERS_PER_INODE_MAX || inode_size < 20 + 4 * ndirect
+       || inode_size > INODE_SIZE_MAX || (inode_size & (inode_size - 1))) {
+        return false;
+    }
+
+    fs_geometry *geo = &fs.geo;
+    geo->block_size = block_size;
+    geo->block_mask = block_size - 1;
+    for(geo->block_shift = 0; (1 << geo->block_shift) < block_size; geo->block_shift++);
+    for(geo->inode_shift = 0; (1 << geo->inode_shift) < inode_size; geo->inode_shift++);
+    geo->inodes_shift = geo->block_shift - geo->inode_shift;
+    geo->ndirect = ndirect;
+    geo->nindirect = block_size / sizeof(int32_t);
+    geo->nlblocks = geo->ndirect + geo->nindirect;
+
+    disk_set_block_size(thedisk, block_size);
+    return true;
+}
+
+// the block size of the mounted filesystem
+int fs_blocksize()
+{
+    return fs.disk ? fs.geo.block_size : BLOCK_SIZE;
+}
+
+// true if block lies in the data area of the mounted filesystem
+// and holds neither inodes nor the inode map
+bool fs_block_valid(int32_t block) {
+    return block > fs.meta.ninodeblocks && block < fs.meta.nblocks
+        && !(fs.inode_blocks && fs.inode_blocks[block]);
+}
+
+// marks block used and keeps its group's free count
+static void fs_take_block(int32_t block) {
+    if(block >= fs.discard_start && block < fs.discard_start + fs.discard_count) {
+        fs_discard_flush(); //the hole must be punched before new data lands
+    }
+    fs.free_blocks[block] = false;
+    fs.refs[block] = 1;
+    fs.group_free[block / BLOCKS_PER_GROUP]--;
+    fs.nfree--;
+}
+
+// adds a pointer to a block that is already in use
+void fs_share_block(int32_t block) {
+    if(fs_block_valid(block) && fs.refs[block]) {
+        fs.refs[block]++;
+        shared_change();
+    }
+}
+
+// drops a pointer to block, returning it to the free pool with the last one
+void fs_release_block(int32_t block) {
+    if(!fs_block_valid(block) || !fs.refs[block]) {
+        return;
+    }
+    if(--fs.refs[block]) {
+        shared_change();
+        return; //still used by a clone
+    }
+    fs.free_blocks[block] = true;
+    fs.group_free[block / BLOCKS_PER_GROUP]++;
+    fs.nfree++;
+
+    //neighbouring frees are gathered into one discard
+    if(fs.discard_count && block == fs.discard_start + fs.discard_count) {
+        fs.discard_count++;
+    } else if(fs.discard_count && block == fs.discard_start - 1) {
+        fs.discard_start--;
+        fs.discard_count++;
+    } else {
+        fs_discard_flush();
+        fs.discard_start = block;
+        fs.discard_count = 1;
+    }
+}
+
+// hands the gathered run of freed blocks back to the host image
+static void fs_discard_flush() {
+    if(fs.discard_count) {
+        disk_discard(thedisk, fs.discard_start, fs.discard_count);
+    }
+    fs.discard_start = 0;
+    fs.discard_count = 0;
+}
+
+// first free block in [from, to) that starts a fully free, aligned chunk
+// (or any free block when whole is false), 0 if there is none
+static int32_t fs_find_free(int32_t from, int32_t to, bool whole) {
+    int32_t i, j;
+    for(i = from; i < to; i++) {
+        if(!fs.free_blocks[i]) {
+            continue;
+        }
+        if(!whole) {
+            return i;
+        }
+        if(i % ALLOC_CHUNK) {
+            continue;
+        }
+        int32_t end = i + ALLOC_CHUNK < to ? i + ALLOC_CHUNK : to;
+        for(j = i; j < end && fs.free_blocks[j]; j++);
+        if(j == end) {
+            return i;
+        }
+        i = j; //j is in use, carry on after it
+    }
+    return 0;
+}
+
+// where a file with no blocks yet should start: each inode gets a home group,
+// so files written side by side are kept apart
+int32_t inode_goal(int inumber) {
+    int32_t goal = (inumber % fs.ngroups) * BLOCKS_PER_GROUP;
+    if(goal <= fs.meta.ninodeblocks) {
+        goal = fs.meta.ninodeblocks + 1;
+    }
+    return goal;
+}
+
+// finds a run of count free data blocks, as close after goal as possible,
+// and marks it used. returns its first block, 0 if there is no such run
+int32_t fs_allocate_free_run(int32_t goal, int count) {
+    int32_t first = fs.meta.ninodeblocks + 1;
+    int32_t i, start = 0;
+    int pass;
+    if(count <= 0 || count > fs.nfree - fs.reserved) {
+        return 0;
+    }
+    if(goal < first || goal >= fs.meta.nblocks) {
+        goal = first;
+    }
+
+    //search from goal to the end, then wrap around to the beginning
+    for(pass = 0; pass < 2; pass++) {
+        int32_t from = pass ? first : goal;
+        int32_t to = pass ? goal + count - 1 : fs.meta.nblocks;
+        if(to > fs.meta.nblocks) {
+            to = fs.meta.nblocks;
+        }
+        start = 0;
+        for(i = from; i < to; i++) {
+            //a run cannot begin in a group with nothing free
+            if(!start && i % BLOCKS_PER_GROUP == 0 && !fs.group_free[i / BLOCKS_PER_GROUP]) {
+                i += BLOCKS_PER_GROUP - 1;
+                continue;
+            }
+            if(!fs.free_blocks[i]) {
+                start = 0;
+                continue;
+            }
+            if(!start) {
+                start = i;
+            }
+            if(i - start + 1 == count) {
+                for(i = start; i < start + count; i++) {
+                    fs_take_block(i);
+                }
+                return start;
+            }
+        }
+    }
+    return 0;
+}
+
+// allocates the free data block that best keeps a file together:
+// goal itself, then the next free chunk in goal's group, then any block there,
+// then the other groups in turn. returns 0 if the disk is full
+int32_t fs_allocate_free_block(int32_t goal) {
+    int32_t first = fs.meta.ninodeblocks + 1;
+    int k;
+    if(fs.nfree - fs.reserved <= 0) {
+        return 0;
+    }
+    if(goal < first || goal >= fs.meta.nblocks) {
+        goal = first;
+    }
+    if(fs.free_blocks[goal]) {
+        fs_take_block(goal);
+        return goal;
+    }
+
+    int group = goal / BLOCKS_PER_GROUP;
+    for(k = 0; k < fs.ngroups; k++) {
+        int g = (group + k) % fs.ngroups;
+        if(!fs.group_free[g]) {
+            continue;
+        }
+        int32_t start = g * BLOCKS_PER_GROUP;
+        int32_t end = start + BLOCKS_PER_GROUP;
+        if(start < first) {
+            start = first;
+        }
+        if(end > fs.meta.nblocks) {
+            end = fs.meta.nblocks;
+        }
+
+        int32_t block = 0;
+        if(!k) {
+            block = fs_find_free(goal, end, true);
+        }
+        if(!block) {
+            block = fs_find_free(start, end, true);
+        }
+        if(!block) {
+            block = fs_find_free(start, end, false);
+        }
+        if(block) {
+            fs_take_block(block);
+            return block;
+        }
+    }
+    return 0;
+}
+
+void blockmap_init(fs_blockmap *map, int inumber, struct fs_inode *inode) {
+    map->inumber = inumber;
+    map->inode = inode;
+    map->loaded = false;
+    map->dirty = false;
+}
+
+// makes block the inode's new, empty indirect block
+void blockmap_add_indirect(fs_blockmap *map, int32_t block) {
+    map->inode->indirect = block;
+    memset(map->indirect.data, 0, fs.geo.block_size);
+    map->loaded = true;
+    map->dirty = true;
+}
+
+// gives the inode its own copy of a loaded indirect block shared with a clone
+// before its pointers change. the copy is written by blockmap_flush
+static bool blockmap_own_indirect(fs_blockmap *map) {
+    struct fs_inode *inode = map->inode;
+    if(fs.refs[inode->indirect] <= 1) {
+        return true;
+    }
+    int32_t goal = inode->direct[fs.geo.ndirect - 1];
+    int32_t copy = fs_allocate_free_block(goal ? goal + 1 : inode_goal(map->inumber));
+    if(!copy) {
+        return false;
+    }
+    fs_release_block(inode->indirect);
+    inode->indirect = copy;
+    map->dirty = true;
+    return true;
+}
+
+// the block a new lblock should ideally land on: right after the file's
+// previous block (the indirect block for the first indirect pointer),
+// otherwise in the inode's home group
+static int32_t blockmap_goal(fs_blockmap *map, int lblock) {
+    if(lblock == fs.geo.ndirect && map->inode->indirect) {
+        return map->inode->indirect + 1;
+    }
+    if(lblock > 0) {
+        int32_t previous = blockmap_get(map, lblock - 1, false);
+        if(previous) {
+            return previous + 1;
+        }
+    }
+    return inode_goal(map->inumber);
+}
+
+// returns the disk block behind logical block lblock, or 0 if there is none
+// with alloc set, missing blocks (and the indirect block) are allocated
+int blockmap_get(fs_blockmap *map, int lblock, bool alloc) {
+    struct fs_inode *inode = map->inode;
+
+    if(lblock < 0 || lblock >= fs.geo.nlblocks) {
+        return 0;
+    }
+
+    // direct blocks
+    if(lblock < fs.geo.ndirect) {
+        if(!inode->direct[lblock] && alloc) {
+            inode->direct[lblock] = fs_allocate_free_block(blockmap_goal(map, lblock));
+        }
+        return inode->direct[lblock];
+    }
+
+    // indirect blocks, placed right after the last direct block
+    if(!inode->indirect) {
+        if(!alloc) {
+            return 0;
+        }
+        int32_t goal = inode->direct[fs.geo.ndirect - 1];
+        int32_t indirect = fs_allocate_free_block(goal ? goal + 1 : inode_goal(map->inumber));
+        if(!indirect) {
+            return 0;
+        }
+        blockmap_add_indirect(map, indirect);
+    }
+    if(!map->loaded) {
+        disk_read(thedisk, inode->indirect, map->indirect.data);
+        map->loaded = true;
+    }
+
+    int *pointer = &map->indirect.pointers[lblock - fs.geo.ndirect];
+    if(!*pointer && alloc) {
+        if(!blockmap_own_indirect(map)) {
+            return 0;
+        }
+        *pointer = fs_allocate_free_block(blockmap_goal(map, lblock));
+        if(*pointer) {
+            map->dirty = true;
+        }
+    }
+    return *pointer;
+}
+
+// points logical block lblock at an already allocated disk block
+// the indirect block must exist when lblock is past the direct pointers
+// false if a shared indirect block could not be copied first
+bool blockmap_set(fs_blockmap *map, int lblock, int block) {
+    if(lblock < fs.geo.ndirect) {
+        map->inode->direct[lblock] = block;
+        return true;
+    }
+    if(!map->loaded) {
+        disk_read(thedisk, map->inode->indirect, map->indirect.data);
+        map->loaded = true;
+    }
+    if(!blockmap_own_indirect(map)) {
+        return false;
+    }
+    map->indirect.pointers[lblock - fs.geo.ndirect] = block;
+    map->dirty = true;
+    return true;
+}
+
+// turns lblock into a hole if its block is shared with a clone, leaving the
+// block and its data to the others. false if the indirect block could not be copied
+bool blockmap_unshare(fs_blockmap *map, int lblock) {
+    int32_t block = blockmap_get(map, lblock, false);
+    if(!block || fs.refs[block] <= 1) {
+        return true;
+    }
+    if(!blockmap_set(map, lblock, 0)) {
+        return false;
+    }
+    fs_release_block(block);
+    return true;
+}
+
+// writes the indirect block back if blockmap_get changed it
+void blockmap_flush(fs_blockmap *map) {
+    if(map->dirty) {
+        disk_write(thedisk, map->inode->indirect, map->indirect.data);
+        map->dirty = false;
+    }
+}
+
+// the buffered data of inumber, null if it has none
+fs_dirty *dirty_find(int inumber) {
+    fs_dirty *dirty;
+    for(dirty = fs.dirty; dirty; dirty = dirty->next) {
+        if(dirty->inumber == inumber) {
+            return dirty;
+        }
+    }
+    return 0;
+}
+
+// the buffered copy of logical block lblock, null if there is none
+unsigned char *dirty_block(int inumber, int lblock) {
+    fs_dirty *dirty = dirty_find(inumber);
+    return dirty ? dirty->blocks[lblock] : 0;
+}
+
+// returns the buffer for lblock, creating a zeroed one and reserving
+// a disk block for it (and for the indirect block it may need) if missing
+// null if the disk has no room left
+static unsigned char *dirty_buffer(int inumber, int lblock, bool hasIndirect) {
+    fs_dirty *dirty = dirty_find(inumber);
+    if(dirty && dirty->blocks[lblock]) {
+        return dirty->blocks[lblock];
+    }
+
+    int needed = 1;
+    if(lblock >= fs.geo.ndirect && !hasIndirect && !(dirty && dirty->indirect)) {
+        needed++;
+    }
+    if(fs.nfree - fs.reserved < needed) {
+        return 0;
+    }
+
+    if(!dirty) {
+        dirty = calloc(1, sizeof(*dirty));
+        if(!dirty) {
+            return 0;
+        }
+        dirty->blocks = calloc(fs.geo.nlblocks, sizeof(*dirty->blocks));
+        if(!dirty->blocks) {
+            free(dirty);
+            return 0;
+        }
+        dirty->inumber = inumber;
+        dirty->next = fs.dirty;
+        fs.dirty = dirty;
+    }
+    unsigned char *buffer = calloc(1, fs.geo.block_size);
+    if(!buffer) {
+        return 0;
+    }
+
+    dirty->blocks[lblock] = buffer;
+    dirty->nblocks++;
+    if(needed > 1) {
+        dirty->indirect = true;
+    }
+    fs.reserved += needed;
+    fs.nbuffered++;
+    return buffer;
+}
+
+// forgets whatever is buffered for inumber and releases its reservation
+void dirty_drop(int inumber) {
+    fs_dirty **link;
+    for(link = &fs.dirty; *link; link = &(*link)->next) {
+        fs_dirty *dirty = *link;
+        if(dirty->inumber != inumber) {
+            continue;
+        }
+        int i;
+        for(i = 0; i < fs.geo.nlblocks; i++) {
+            if(dirty->blocks[i]) {
+                free(dirty->blocks[i]);
+                fs.reserved--;
+                fs.nbuffered--;
+            }
+        }
+        fs.reserved -= dirty->indirect;
+        *link = dirty->next;
+        free(dirty->blocks);
+        free(dirty);
+        return;
+    }
+}
+
+// fast non-cryptographic hash of a block's contents
+static uint64_t block_hash(const unsigned char *data) {
+    const uint64_t *words = (const uint64_t *)data;
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
+    int i;
+    for(i = 0; i < fs.geo.block_size / 8; i++) {
+        hash ^= words[i] * 0xff51afd7ed558ccdULL;
+        hash = ((hash << 27) | (hash >> 37)) * 0xc4ceb9fe1a85ec53ULL;
+    }
+    hash ^= hash >> 33;
+    return hash ? hash : 1;
+}
+
+static bool block_is_zero(const unsigned char *data) {
+    const uint64_t *words = (const uint64_t *)data;
+    int i;
+    for(i = 0; i < fs.geo.block_size / 8; i++) {
+        if(words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the index slot for hash: its entry, or the empty slot it would go in
+static fs_dedup_entry *dedup_slot(uint64_t hash) {
+    int i = hash & (fs.index_size - 1);
+    while(fs.index[i].block && fs.index[i].hash != hash) {
+        i = (i + 1) & (fs.index_size - 1);
+    }
+    return &fs.index[i];
+}
+
+// remembers that block holds data. entries are only hints: blocks are
+// freed and overwritten without updating the index
+static void dedup_insert(const unsigned char *data, int32_t block) {
+    if(!fs.index) {
+        return;
+    }
+    //keep the table at most 3/4 full by dropping entries for freed blocks,
+    //or starting over when that is not enough
+    if(fs.index_count >= fs.index_size / 4 * 3) {
+        int i, count = 0;
+        fs_dedup_entry *old = fs.index;
+        fs.index = calloc(fs.index_size, sizeof(fs_dedup_entry));
+        if(!fs.index) {
+            fs.index = old;
+            return;
+        }
+        for(i = 0; i < fs.index_size; i++) {
+            if(old[i].block && fs.refs[old[i].block] && count < fs.index_size / 2) {
+                *dedup_slot(old[i].hash) = old[i];
+                count++;
+            }
+        }
+        free(old);
+        fs.index_count = count;
+    }
+
+    uint64_t hash = block_hash(data);
+    fs_dedup_entry *entry = dedup_slot(hash);
+    if(!entry->block) {
+        fs.index_count++;
+    }
+    entry->hash = hash;
+    entry->block = block;
+}
+
+// points lblock at a block already holding data: a hole for zeros, or a
+// block found in the index and verified byte for byte. the block lblock
+// pointed to before is left to the caller. returns the new block (0 for
+// a hole), or -1 if data has to be written out as usual
+static int32_t dedup_match(fs_blockmap *map, int lblock, const unsigned char *data) {
+    int32_t match = 0;
+    if(!block_is_zero(data)) {
+        fs_dedup_entry *entry = dedup_slot(block_hash(data));
+        match = entry->block;
+        if(!match || !fs_block_valid(match) || !fs.refs[match]) {
+            return -1;
+        }
+        union fs_block stored;
+        disk_read(thedisk, match, stored.data);
+        if(memcmp(stored.data, data, fs.geo.block_size)) {
+            return -1;
+        }
+    }
+
+    if(lblock >= fs.geo.ndirect && !map->inode->indirect) {
+        if(!match) {
+            return 0; //a hole needs no indirect block
+        }
+        int32_t goal = map->inode->direct[fs.geo.ndirect - 1];
+        int32_t indirect = fs_allocate_free_block(goal ? goal + 1 : inode_goal(map->inumber));
+        if(!indirect) {
+            return -1;
+        }
+        blockmap_add_indirect(map, indirect);
+    }
+    if(blockmap_get(map, lblock, false) == match) {
+        return match;
+    }
+    if(!blockmap_set(map, lblock, match)) {
+        return -1;
+    }
+    fs_share_block(match);
+    return match;
+}
+
+// reads the whole of inode 0 into a new buffer without going through the
+// mount, so fsck can use it too. null if it holds nothing
+static char *meta_read(int *length) {
+    struct fs_inode inode;
+    inode_load(META_INODE, &inode);
+    if(!inode.isvalid || inode.size < 8 || inode.size > (int64_t)fs.geo.nlblocks << fs.geo.block_shift) {
+        return 0;
+    }
+    int nblocks = disk_nblocks(thedisk);
+    if(inode.indirect < 0 || inode.indirect >= nblocks) {
+        inode.indirect = 0; //fsck reports it, read what can be read
+    }
+    char *saved = malloc(inode.size);
+    if(!saved) {
+        return 0;
+    }
+    fs_blockmap map;
+    blockmap_init(&map, META_INODE, &inode);
+    union fs_block block;
+    int offset;
+    for(offset = 0; offset < inode.size; offset += fs.geo.block_size) {
+        int32_t b = blockmap_get(&map, offset >> fs.geo.block_shift, false);
+        if(b > 0 && b < nblocks) {
+            disk_read(thedisk, b, block.data);
+        } else {
+            memset(block.data, 0, fs.geo.block_size);
+        }
+        int chunk = inode.size - offset < fs.geo.block_size ? inode.size - offset : fs.geo.block_size;
+        memcpy(saved + offset, block.data, chunk);
+    }
+    *length = inode.size;
+    return saved;
+}
+
+// finds the section of inode 0 that starts with magic and returns its
+// entries, null if there is none. inode 0 is a series of sections, each a
+// magic number and an entry count followed by the entries
+static const char *meta_section(const char *saved, int length, uint32_t magic, uint32_t *count) {
+    int offset = 0;
+    while(offset + 8 <= length) {
+        const uint32_t *header = (const uint32_t *)(saved + offset);
+        int size = header[0] == DEDUP_MAGIC ? sizeof(fs_dedup_entry) : sizeof(fs_shared_run);
+        if(header[0] != DEDUP_MAGIC && header[0] != SHARED_MAGIC) {
+            return 0;
+        }
+        uint32_t n = header[1];
+        if(header[0] == magic) {
+            *count = n;
+            return saved + offset + 8;
+        }
+        if(n > (uint32_t)(length - offset - 8) / size) {
+            return 0;
+        }
+        offset += 8 + n * size;
+    }
+    return 0;
+}
+
+// how many pointers each block may have according to the shared block map,
+// 0 for blocks it does not list. an image from before the map shares nothing,
+// so it gets an empty one. null if the map is stale or did not fit in inode 0,
+// when any sharing has to be trusted
+static uint32_t *shared_load() {
+    struct fs_superblock *super = fs.disk ? &fs.meta : &check.meta;
+    if(super->features & FS_SHARED_STALE) {
+        return 0;
+    }
+    uint32_t *expected = calloc(super->nblocks, sizeof(uint32_t));
+    if(!(super->features & FS_SHARED_MAP)) {
+        return expected;
+    }
+    int length;
+    char *saved = meta_read(&length);
+    uint32_t i, count;
+    const fs_shared_run *runs = saved ? (const fs_shared_run *)meta_section(saved, length, SHARED_MAGIC, &count) : 0;
+    if(expected && runs) {
+        if(count == UINT32_MAX || count > (uint32_t)(saved + length - (const char *)runs) / sizeof(fs_shared_run)) {
+            free(expected);
+            expected = 0;
+            count = 0;
+        }
+        for(i = 0; i < count; i++) {
+            int32_t b;
+            for(b = runs[i].start; b >= 0 && b < runs[i].start + runs[i].length && b < super->nblocks; b++) {
+                expected[b] = runs[i].refs;
+            }
+        }
+    }
+    free(saved);
+    return expected;
+}
+
+// fills the dedup index from the copy saved in inode 0 at the last unmount
+static void meta_load() {
+    int length;
+    char *saved = meta_read(&length);
+    uint32_t i, count;
+    const fs_dedup_entry *entries = saved ? (const fs_dedup_entry *)meta_section(saved, length, DEDUP_MAGIC, &count) : 0;
+    if(!entries || !fs_dedup(1)) {
+        free(saved);
+        return;
+    }
+    fs.dedup = false; //loading the index does not turn deduplication on
+
+    if(count > (uint32_t)(saved + length - (const char *)entries) / sizeof(fs_dedup_entry)) {
+        count = (saved + length - (const char *)entries) / sizeof(fs_dedup_entry);
+    }
+    for(i = 0; i < count && fs.index_count < fs.index_size / 2; i++) {
+        int32_t block = entries[i].block;
+        if(fs_block_valid(block) && fs.refs[block]) {
+            fs_dedup_entry *entry = dedup_slot(entries[i].hash);
+            if(!entry->block) {
+                fs.index_count++;
+            }
+            *entry = entries[i];
+        }
+    }
+    free(saved);
+}
+
+// notes that sharing no longer matches the map saved in inode 0. the map on
+// disk is marked stale at once, so that a crash before the next sync does
+// not make this sharing look like cross-linked blocks
+static void shared_change() {
+    fs.shared_changed = true;
+    if((fs.meta.features & FS_SHARED_MAP) && !(fs.meta.features & FS_SHARED_STALE)) {
+        fs.meta.features |= FS_SHARED_STALE;
+        super_save();
+    }
+}
+
+// stores the shared block map and the live part of the dedup index as the
+// contents of inode 0. the map goes first, the index only gets what room is left
+static void meta_save() {
+    int64_t limit = (int64_t)fs.geo.nlblocks << fs.geo.block_shift;
+    int32_t i;
+    uint32_t nruns = 0;
+    bool shared = fs.meta.features & FS_SHARED_MAP;
+
+    //count the runs first to size the buffer
+    for(i = fs.meta.ninodeblocks + 1; shared && i < fs.meta.nblocks; i++) {
+        if(fs.refs[i] > 1 && (i == fs.meta.ninodeblocks + 1 || fs.refs[i - 1] != fs.refs[i])) {
+            nruns++;
+        }
+    }
+    int64_t size = shared ? 8 + (int64_t)nruns * sizeof(fs_shared_run) : 0;
+    bool overflow = size > limit;
+    if(overflow) {
+        nruns = 0; //too much sharing to list, saved as not kept
+        size = 8;
+    }
+    int capacity = fs.index ? (limit - size - 8) / sizeof(fs_dedup_entry) : 0;
+    if(capacity > fs.index_count) {
+        capacity = fs.index_count;
+    }
+    char *saved = malloc(size + 8 + (int64_t)capacity * sizeof(fs_dedup_entry));
+    if(!saved) {
+        return;
+    }
+
+    char *at = saved;
+    if(shared) {
+        ((uint32_t *)at)[0] = SHARED_MAGIC;
+        ((uint32_t *)at)[1] = overflow ? UINT32_MAX : nruns;
+        fs_shared_run *runs = (fs_shared_run *)(at + 8);
+        int n = 0;
+        for(i = fs.meta.ninodeblocks + 1; nruns && i < fs.meta.nblocks; i++) {
+            if(fs.refs[i] <= 1) {
+                continue;
+            }
+            if(n && runs[n - 1].start + runs[n - 1].length == i && runs[n - 1].refs == fs.refs[i]) {
+                runs[n - 1].length++;
+            } else {
+                runs[n].start = i;
+                runs[n].length = 1;
+                runs[n].refs = fs.refs[i];
+                n++;
+            }
+        }
+        at += size;
+    }
+    if(fs.index) {
+        fs_dedup_entry *entries = (fs_dedup_entry *)(at + 8);
+        int count = 0;
+        for(i = 0; i < fs.index_size && count < capacity; i++) {
+            if(fs.index[i].block && fs.refs[fs.index[i].block]) {
+                entries[count++] = fs.index[i];
+            }
+        }
+        ((uint32_t *)at)[0] = DEDUP_MAGIC;
+        ((uint32_t *)at)[1] = count;
+        at += 8 + count * sizeof(fs_dedup_entry);
+    }
+    fs.shared_changed = false;
+
+    //inode 0 itself is never deduplicated
+    bool enabled = fs.dedup;
+    fs.dedup = false;
+
+    //the map on disk stops counting until its replacement is complete
+    if(shared) {
+        fs.meta.features |= FS_SHARED_STALE;
+        super_save();
+    }
+
+    struct fs_inode inode;
+    inode_load(META_INODE, &inode);
+    if(inode.isvalid) {
+        inode_delete(META_INODE);
+    }
+    memset(&inode, 0, sizeof(inode));
+    inode.isvalid = true;
+    inode.ctime = time(0);
+    inode_save(META_INODE, &inode);
+    bool saved_all = inode_write(META_INODE, saved, at - saved, 0) == at - saved && fs_flush(META_INODE);
+
+    if(shared && saved_all && !overflow) {
+        fs.meta.features &= ~FS_SHARED_STALE;
+        super_save();
+    } else if(shared && !saved_all) {
+        fs.shared_changed = true; //try again at the next sync
+    }
+
+    fs.dedup = enabled;
+    free(saved);
 }
@@ -1,9 +1,10 @@
 #ifndef FS_H
 #define FS_H
 
-int  fs_format();
+int  fs_format( int block_size, int ndirect, int inode_ratio );
 void fs_debug();
 int  fs_mount();
+int  fs_unmount();
 
 int  fs_create();
 int  fs_delete( int inumber );
@@ -11,5 +12,17 @@ int  fs_getsize();
 
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_fallocate( int inumber, int offset, int length );
+int  fs_flush( int inumber );
+int  fs_sync();
+int  fs_defrag( int compact, int rate );
+int  fs_check( int repair );
+int  fs_clone( int inumber );
+int  fs_snapshot( int *clones, int max );
+int  fs_dedup( int enable );
+int  fs_blocksize();
+
+int  fs_read_fd( int inumber, int fd, int length, int offset );
+int  fs_write_fd( int inumber, int fd, int length, int offset );
 
 #endif
@@ -6,9 +6,19 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_LIST 4096 /* clones listed by the snapshot command */
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static void do_stats( int reset );
+
+/* devices for the "model" command: request, seek per block, longest seek, MB/s, queue depth */
+static const struct disk_model model_hdd = { 100000, 25, 8000000, 150, 32 };
+static const struct disk_model model_ssd = { 20000, 0, 0, 2000, 32 };
 
 struct disk *thedisk = 0;
 
@@ -18,14 +28,15 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
+	char arg3[1024];
 	int inumber, result, args;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(argc!=3 && argc!=4) {
+		printf("use: %s <diskfile>[,<diskfile>...] <nblocks> [stripe-blocks]\n",argv[0]);
 		return 1;
 	}
 
-	thedisk = disk_open(argv[1],atoi(argv[2]));
+	thedisk = disk_open_striped(argv[1],atoi(argv[2]),argc==4 ? atoi(argv[3]) : DISK_STRIPE_BLOCKS);
 	if(!thedisk) {
 		printf("couldn't open %s: %s\n",argv[1],strerror(errno));
 		return 1;
@@ -42,18 +53,18 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+		args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
+			if(args<=4) {
+				if(fs_format(args>1 ? atoi(arg1) : 0, args>2 ? atoi(arg2) : 0, args>3 ? atoi(arg3) : 0)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [block-size] [direct-pointers] [bytes-per-inode]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
@@ -65,6 +76,16 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: mount\n");
 			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount()) {
+					printf("disk unmounted.\n");
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
 				fs_debug();
@@ -140,16 +161,141 @@ int main( int argc, char *argv[] )
 				printf("use: copyout <inumber> <filename>\n");
 			}
 
+		} else if(!strcmp(cmd,"fallocate")) {
+			if(args==4) {
+				inumber = atoi(arg1);
+				if(fs_fallocate(inumber,atoi(arg2),atoi(arg3))) {
+					printf("reserved %d bytes at offset %d in inode %d\n",atoi(arg3),atoi(arg2),inumber);
+				} else {
+					printf("fallocate failed!\n");
+				}
+			} else {
+				printf("use: fallocate <inumber> <offset> <length>\n");
+			}
+
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync()) {
+					printf("buffered data written.\n");
+				} else {
+					printf("sync failed!\n");
+				}
+			} else {
+				printf("use: sync\n");
+			}
+
+		} else if(!strcmp(cmd,"defrag")) {
+			if(args==1) {
+				result = fs_defrag(0,0);
+			} else if(args==2 && !strcmp(arg1,"compact")) {
+				result = fs_defrag(1,0);
+			} else if(args==3 && !strcmp(arg1,"compact")) {
+				result = fs_defrag(1,atoi(arg2));
+			} else if(args==2) {
+				result = fs_defrag(0,atoi(arg1));
+			} else {
+				printf("use: defrag [compact] [blocks-per-second]\n");
+				result = 1;
+			}
+			if(!result) {
+				printf("defrag failed!\n");
+			}
+
+		} else if(!strcmp(cmd,"check")) {
+			if(args==1 || (args==2 && !strcmp(arg1,"repair"))) {
+				if(fs_check(args==2)) {
+					printf("filesystem is consistent.\n");
+				} else {
+					printf("check found problems!\n");
+				}
+			} else {
+				printf("use: check [repair]\n");
+			}
+
+		} else if(!strcmp(cmd,"clone")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				result = fs_clone(inumber);
+				if(result>0) {
+					printf("cloned inode %d to inode %d\n",inumber,result);
+				} else {
+					printf("clone failed!\n");
+				}
+			} else {
+				printf("use: clone <inumber>\n");
+			}
+
+		} else if(!strcmp(cmd,"snapshot")) {
+			if(args==1) {
+				static int clones[2*SNAPSHOT_LIST];
+				result = fs_snapshot(clones,SNAPSHOT_LIST);
+				int i;
+				for(i=0;i<result && i<SNAPSHOT_LIST;i++) {
+					printf("inode %d -> %d\n",clones[2*i],clones[2*i+1]);
+				}
+				if(result>SNAPSHOT_LIST) {
+					printf("(and %d more)\n",result-SNAPSHOT_LIST);
+				}
+				if(result>=0) {
+					printf("snapshot of %d inodes taken\n",result);
+				} else {
+					printf("snapshot failed!\n");
+				}
+			} else {
+				printf("use: snapshot\n");
+			}
+
+		} else if(!strcmp(cmd,"dedup")) {
+			if(args==2 && (!strcmp(arg1,"on") || !strcmp(arg1,"off"))) {
+				if(fs_dedup(!strcmp(arg1,"on"))) {
+					printf("deduplication %s.\n",arg1);
+				} else {
+					printf("dedup failed!\n");
+				}
+			} else {
+				printf("use: dedup on|off\n");
+			}
+
+		} else if(!strcmp(cmd,"model")) {
+			if((args==2 || args==3) && (!strcmp(arg1,"hdd") || !strcmp(arg1,"ssd") || !strcmp(arg1,"off"))) {
+				struct disk_model model = !strcmp(arg1,"hdd") ? model_hdd : model_ssd;
+				if(args==3) model.queue_depth = atoi(arg2);
+				if(disk_set_model(thedisk,strcmp(arg1,"off") ? &model : 0)==0) {
+					printf("device model %s.\n",arg1);
+				} else {
+					printf("model failed!\n");
+				}
+			} else {
+				printf("use: model hdd|ssd|off [queue-depth]\n");
+			}
+
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1 || (args==2 && !strcmp(arg1,"reset"))) {
+				do_stats(args==2);
+			} else {
+				printf("use: stats [reset]\n");
+			}
+
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [block-size] [direct-pointers] [bytes-per-inode]\n");
 			printf("    mount\n");
+			printf("    unmount\n");
 			printf("    debug\n");
 			printf("    create\n");
 			printf("    delete  <inode>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    fallocate <inode> <offset> <length>\n");
+			printf("    sync\n");
+			printf("    defrag  [compact] [blocks-per-second]\n");
+			printf("    check   [repair]\n");
+			printf("    clone   <inode>\n");
+			printf("    snapshot\n");
+			printf("    dedup   on|off\n");
+			printf("    model   hdd|ssd|off [queue-depth]\n");
+			printf("    stats   [reset]\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -164,6 +310,7 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	fs_unmount();
 	printf("closing emulated disk.\n");
 	disk_close(thedisk);
 
@@ -173,12 +320,30 @@ int main( int argc, char *argv[] )
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
+	int offset=0, result, actual, fd;
+	int block_size = fs_blocksize();
 	char buffer[16384];
+	struct stat info;
+
+	fd = open(filename,O_RDONLY);
+	if(fd<0) {
+		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
 
-	file = fopen(filename,"r");
+	/* move the block-aligned part without touching the bytes */
+	if(!fstat(fd,&info) && S_ISREG(info.st_mode) && info.st_size>=block_size) {
+		result = info.st_size < (1<<30) ? info.st_size : (1<<30);
+		result -= result%block_size;
+		actual = fs_write_fd(inumber,fd,result,0);
+		if(actual>0) offset = actual;
+		lseek(fd,offset,SEEK_SET);
+	}
+
+	file = fdopen(fd,"r");
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		close(fd);
 		return 0;
 	}
 
@@ -199,6 +364,9 @@ static int do_copyin( const char *filename, int inumber )
 		}
 	}
 
+	/* the file is complete, so its buffered blocks can be placed now */
+	fs_flush(inumber);
+
 	printf("%d bytes copied\n",offset);
 
 	fclose(file);
@@ -208,12 +376,27 @@ static int do_copyin( const char *filename, int inumber )
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
+	int offset=0, result, fd;
+	int block_size = fs_blocksize();
 	char buffer[16384];
 
-	file = fopen(filename,"w");
+	fd = open(filename,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(fd<0) {
+		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+
+	/* move the block-aligned part without touching the bytes */
+	result = fs_getsize(inumber);
+	if(result>=block_size) {
+		fflush(stdout);
+		offset = fs_read_fd(inumber,fd,result-result%block_size,0);
+	}
+
+	file = fdopen(fd,"w");
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		close(fd);
 		return 0;
 	}
 
@@ -230,3 +413,18 @@ static int do_copyout( int inumber, const char *filename )
 	return 1;
 }
 
+static void do_stats( int reset )
+{
+	struct disk_stats stats;
+	disk_stats(thedisk,&stats,reset);
+
+	printf("%lld reads of %lld bytes, %lld writes of %lld bytes, %lld discards of %lld bytes\n",
+		(long long)stats.reads,(long long)stats.bytes_read,(long long)stats.writes,(long long)stats.bytes_written,
+		(long long)stats.discards,(long long)stats.bytes_discarded);
+	if(stats.busy_ns) {
+		printf("simulated time: %.3f ms busy (reads %.3f ms, writes %.3f ms, discards %.3f ms)\n",
+			stats.busy_ns/1e6,stats.read_ns/1e6,stats.write_ns/1e6,stats.discard_ns/1e6);
+		printf("%lld seeks over %lld blocks, %.3f ms average read latency\n",
+			(long long)stats.seeks,(long long)stats.seek_distance,stats.reads ? stats.read_wait_ns/1e6/stats.reads : 0.0);
+	}
+}
@@ -0,0 +1,340 @@
+
+/*
+simplefsd mounts a disk image once and serves the fs.h operations to any
+number of local clients over a Unix domain socket, using the protocol in
+simplefsd.h. Everything runs in one thread: requests from all clients are
+executed one at a time, so the filesystem never sees concurrent calls.
+
+Clients may pipeline requests. Every request that has fully arrived on a
+connection is executed as soon as it is read, and all of their answers go
+back in a single write.
+*/
+
+#include "fs.h"
+#include "disk.h"
+#include "simplefsd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SFSD_MAX_CLIENTS 64
+#define SFSD_READ_SIZE   65536     /* bytes asked of the socket per read */
+#define SFSD_MAX_PENDING (32 << 20) /* answers queued before a client stops being read */
+
+struct client {
+	int fd;
+	unsigned char *in;   /* received, not yet executed */
+	size_t in_len, in_cap;
+	unsigned char *out;  /* answers not yet sent */
+	size_t out_len, out_sent, out_cap;
+	int eof;             /* the client will send no more, close once answered */
+};
+
+struct disk *thedisk = 0;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void do_stop( int sig )
+{
+	stopping = 1;
+}
+
+/* makes room for "extra" more bytes after the first "len" of a buffer */
+static int reserve( unsigned char **buffer, size_t *cap, size_t len, size_t extra )
+{
+	if(len+extra<=*cap) return 1;
+	size_t size = *cap ? *cap : SFSD_READ_SIZE;
+	while(size<len+extra) size *= 2;
+	unsigned char *bigger = realloc(*buffer,size);
+	if(!bigger) return 0;
+	*buffer = bigger;
+	*cap = size;
+	return 1;
+}
+
+/* false if an inumber, length or offset the op uses is negative, or if
+   it would change inode 0, which holds the filesystem's own records */
+static int valid_args( const struct sfsd_request *req )
+{
+	switch(req->op) {
+		case SFSD_GETSIZE:
+		case SFSD_FLUSH:
+			return req->arg[0]>=0;
+		case SFSD_DELETE:
+		case SFSD_CLONE:
+			return req->arg[0]>0;
+		case SFSD_SNAPSHOT:
+			return req->arg[1]>=0;
+		case SFSD_READ:
+			return req->arg[0]>=0 && req->arg[1]>=0 && req->arg[2]>=0;
+		case SFSD_FALLOCATE:
+			return req->arg[0]>0 && req->arg[1]>=0 && req->arg[2]>=0;
+		case SFSD_WRITE:
+			return req->arg[0]>0 && req->arg[2]>=0;
+		default:
+			return 1;
+	}
+}
+
+/* runs one request and queues its answer, returns 0 if out of memory */
+static int do_request( struct client *c, const struct sfsd_request *req, const unsigned char *payload )
+{
+	struct sfsd_response resp;
+	int length = 0;
+
+	if(req->op==SFSD_READ || req->op==SFSD_SNAPSHOT) {
+		length = req->arg[1];
+		if(length<0) length = 0;
+		if(length>SFSD_MAX_PAYLOAD) length = SFSD_MAX_PAYLOAD;
+	}
+	if(!reserve(&c->out,&c->out_cap,c->out_len,sizeof(resp)+length)) return 0;
+
+	/* read straight into the output buffer behind the header */
+	unsigned char *data = c->out+c->out_len+sizeof(resp);
+
+	resp.tag = req->tag;
+	resp.size = 0;
+	if(!valid_args(req)) {
+		resp.result = SFSD_EINVAL;
+		memcpy(c->out+c->out_len,&resp,sizeof(resp));
+		c->out_len += sizeof(resp);
+		return 1;
+	}
+	switch(req->op) {
+		case SFSD_CREATE:    resp.result = fs_create(); break;
+		case SFSD_DELETE:    resp.result = fs_delete(req->arg[0]); break;
+		case SFSD_GETSIZE:   resp.result = fs_getsize(req->arg[0]); break;
+		case SFSD_READ:
+			resp.result = fs_read(req->arg[0],(char*)data,length,req->arg[2]);
+			if(resp.result>0) resp.size = resp.result;
+			break;
+		case SFSD_WRITE:     resp.result = fs_write(req->arg[0],(const char*)payload,req->size,req->arg[2]); break;
+		case SFSD_FALLOCATE: resp.result = fs_fallocate(req->arg[0],req->arg[2],req->arg[1]); break;
+		case SFSD_FLUSH:     resp.result = fs_flush(req->arg[0]); break;
+		case SFSD_SYNC:      resp.result = fs_sync(); break;
+		case SFSD_CLONE:     resp.result = fs_clone(req->arg[0]); break;
+		case SFSD_SNAPSHOT: {
+			/* as many pairs as the client made room for, copied since data is not aligned */
+			int max = length/(2*sizeof(int32_t));
+			int *clones = malloc((max ? max : 1)*2*sizeof(int));
+			if(!clones) return 0;
+			resp.result = fs_snapshot(clones,max);
+			if(resp.result>0) resp.size = (resp.result<max ? resp.result : max)*2*sizeof(int32_t);
+			memcpy(data,clones,resp.size);
+			free(clones);
+			break;
+		}
+		case SFSD_DEDUP:     resp.result = fs_dedup(req->arg[0]); break;
+		case SFSD_DEFRAG:    resp.result = fs_defrag(req->arg[0],req->arg[1]); break;
+		case SFSD_CHECK:     resp.result = fs_check(req->arg[0]); break;
+		case SFSD_BLOCKSIZE: resp.result = fs_blocksize(); break;
+		default:             resp.result = SFSD_EBADOP; break;
+	}
+
+	memcpy(c->out+c->out_len,&resp,sizeof(resp));
+	c->out_len += sizeof(resp)+resp.size;
+	return 1;
+}
+
+/* executes the complete requests received so far, stopping while
+   SFSD_MAX_PENDING bytes of answers wait to be sent; the rest stays in
+   c->in until they are. returns 0 when the connection should be closed */
+static int do_requests( struct client *c )
+{
+	size_t pos = 0;
+	while(c->in_len-pos>=sizeof(struct sfsd_request) && c->out_len<SFSD_MAX_PENDING) {
+		struct sfsd_request req;
+		memcpy(&req,c->in+pos,sizeof(req));
+		if(req.size>SFSD_MAX_PAYLOAD) {
+			printf("client %d: request of %u bytes is too large\n",c->fd,req.size);
+			return 0;
+		}
+		if(c->in_len-pos<sizeof(req)+req.size) {
+			/* wait for the rest, making room for it */
+			if(!reserve(&c->in,&c->in_cap,c->in_len,sizeof(req)+req.size)) return 0;
+			break;
+		}
+		if(!do_request(c,&req,c->in+pos+sizeof(req))) return 0;
+		pos += sizeof(req)+req.size;
+	}
+
+	memmove(c->in,c->in+pos,c->in_len-pos);
+	c->in_len -= pos;
+	return 1;
+}
+
+/* reads what the client has sent and executes the complete requests
+   notes the end of input in c->eof, returns 0 when the connection should be closed */
+static int do_input( struct client *c )
+{
+	if(!reserve(&c->in,&c->in_cap,c->in_len,SFSD_READ_SIZE)) return 0;
+
+	ssize_t actual = read(c->fd,c->in+c->in_len,c->in_cap-c->in_len);
+	if(actual<0 && (errno==EINTR || errno==EAGAIN)) return 1;
+	if(actual==0) {
+		c->eof = 1; /* a half-close still gets its answers */
+		return 1;
+	}
+	if(actual<0) return 0;
+	c->in_len += actual;
+
+	return do_requests(c);
+}
+
+/* true if a whole request is waiting in c->in */
+static int has_request( const struct client *c )
+{
+	struct sfsd_request req;
+	if(c->in_len<sizeof(req)) return 0;
+	memcpy(&req,c->in,sizeof(req));
+	return c->in_len>=sizeof(req)+req.size;
+}
+
+/* sends queued answers, returns 0 when the connection should be closed */
+static int do_output( struct client *c )
+{
+	while(c->out_sent<c->out_len) {
+		ssize_t actual = write(c->fd,c->out+c->out_sent,c->out_len-c->out_sent);
+		if(actual<0 && errno==EINTR) continue;
+		if(actual<0 && errno==EAGAIN) return 1;
+		if(actual<=0) return 0;
+		c->out_sent += actual;
+	}
+	c->out_len = 0;
+	c->out_sent = 0;
+	return 1;
+}
+
+static void do_close( struct client *c )
+{
+	close(c->fd);
+	free(c->in);
+	free(c->out);
+	memset(c,0,sizeof(*c));
+	c->fd = -1;
+}
+
+int main( int argc, char *argv[] )
+{
+	struct client clients[SFSD_MAX_CLIENTS];
+	struct pollfd fds[SFSD_MAX_CLIENTS+1];
+	struct sockaddr_un addr;
+	int listener, i;
+
+	if(argc!=4 && argc!=5) {
+		printf("use: %s <diskfile>[,<diskfile>...] <nblocks> <socket> [stripe-blocks]\n",argv[0]);
+		return 1;
+	}
+
+	thedisk = disk_open_striped(argv[1],atoi(argv[2]),argc==5 ? atoi(argv[4]) : DISK_STRIPE_BLOCKS);
+	if(!thedisk) {
+		printf("couldn't open %s: %s\n",argv[1],strerror(errno));
+		return 1;
+	}
+	if(!fs_mount()) {
+		printf("couldn't mount %s\n",argv[1]);
+		disk_close(thedisk);
+		return 1;
+	}
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(argv[3])>=sizeof(addr.sun_path)) {
+		printf("socket path %s is too long\n",argv[3]);
+		return 1;
+	}
+	strcpy(addr.sun_path,argv[3]);
+	unlink(argv[3]);
+
+	listener = socket(AF_UNIX,SOCK_STREAM,0);
+	if(listener<0 || bind(listener,(struct sockaddr*)&addr,sizeof(addr))<0 || listen(listener,SFSD_MAX_CLIENTS)<0) {
+		printf("couldn't listen on %s: %s\n",argv[3],strerror(errno));
+		return 1;
+	}
+
+	signal(SIGPIPE,SIG_IGN);
+	struct sigaction stop;
+	memset(&stop,0,sizeof(stop));
+	stop.sa_handler = do_stop;
+	sigaction(SIGINT,&stop,0);
+	sigaction(SIGTERM,&stop,0);
+
+	for(i=0;i<SFSD_MAX_CLIENTS;i++) {
+		memset(&clients[i],0,sizeof(clients[i]));
+		clients[i].fd = -1;
+	}
+
+	printf("serving %s with %d blocks on %s\n",argv[1],disk_nblocks(thedisk),argv[3]);
+	fflush(stdout);
+
+	while(!stopping) {
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for(i=0;i<SFSD_MAX_CLIENTS;i++) {
+			struct client *c = &clients[i];
+			fds[i+1].fd = c->fd;
+			fds[i+1].events = 0;
+			if(c->out_len>c->out_sent) fds[i+1].events |= POLLOUT;
+			if(c->out_len<SFSD_MAX_PENDING && !c->eof) fds[i+1].events |= POLLIN;
+		}
+
+		if(poll(fds,SFSD_MAX_CLIENTS+1,-1)<0) {
+			if(errno==EINTR) continue;
+			printf("poll failed: %s\n",strerror(errno));
+			break;
+		}
+
+		if(fds[0].revents&POLLIN) {
+			int fd = accept(listener,0,0);
+			for(i=0;fd>=0 && i<SFSD_MAX_CLIENTS;i++) {
+				if(clients[i].fd<0) {
+					fcntl(fd,F_SETFL,O_NONBLOCK);
+					clients[i].fd = fd;
+					break;
+				}
+			}
+			if(fd>=0 && i==SFSD_MAX_CLIENTS) {
+				printf("too many clients\n");
+				close(fd);
+			}
+		}
+
+		for(i=0;i<SFSD_MAX_CLIENTS;i++) {
+			struct client *c = &clients[i];
+			short events = fds[i+1].revents;
+			if(c->fd<0 || fds[i+1].fd!=c->fd || !events) continue;
+
+			int ok = 1;
+			if(events&(POLLIN|POLLHUP|POLLERR) && !c->eof) ok = do_input(c);
+			else if(events&(POLLHUP|POLLERR)) ok = 0; /* gone before taking its answers */
+			if(ok && c->out_len>c->out_sent) ok = do_output(c);
+			/* requests held back by a full queue carry on once it drains, as
+			   no more input may come to wake them */
+			if(ok && c->out_len<SFSD_MAX_PENDING && has_request(c)) ok = do_requests(c);
+			if(ok && c->eof && c->out_len==c->out_sent && !has_request(c)) ok = 0; /* all answered */
+			if(!ok) {
+				do_output(c); /* answers to what did arrive, if the client still listens */
+				do_close(c);
+			}
+		}
+	}
+
+	for(i=0;i<SFSD_MAX_CLIENTS;i++) {
+		if(clients[i].fd>=0) do_close(&clients[i]);
+	}
+	close(listener);
+	unlink(argv[3]);
+
+	printf("closing emulated disk.\n");
+	fs_unmount();
+	disk_close(thedisk);
+	return 0;
+}
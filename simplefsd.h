@@ -0,0 +1,59 @@
+#ifndef SIMPLEFSD_H
+#define SIMPLEFSD_H
+
+#include <stdint.h>
+
+/*
+Wire protocol of simplefsd, the daemon that serves one mounted image to
+local clients over a Unix domain socket.
+
+A client sends requests back to back without waiting for answers. Each is
+a struct sfsd_request followed by "size" bytes of payload (only SFSD_WRITE
+carries any). The daemon answers every request, in the order they were sent,
+with a struct sfsd_response followed by "size" bytes of payload (only
+SFSD_READ and SFSD_SNAPSHOT return any). "tag" is copied from the request so a client can
+match answers to requests. Integers are in host byte order, since both ends
+run on the same machine.
+
+"result" is what the fs.h function returned, SFSD_EBADOP for an unknown op,
+or SFSD_EINVAL when an inumber, offset or length is negative, or a call
+would change inode 0 (which holds the filesystem's own records), and the
+call was not made at all.
+*/
+
+#define SFSD_MAX_PAYLOAD (16 << 20)
+#define SFSD_EBADOP      (-1000)
+#define SFSD_EINVAL      (-1001)
+
+enum sfsd_op {
+	SFSD_CREATE = 1,  /* fs_create() */
+	SFSD_DELETE,      /* fs_delete(arg[0]) */
+	SFSD_GETSIZE,     /* fs_getsize(arg[0]) */
+	SFSD_READ,        /* fs_read(arg[0], reply payload, arg[1], arg[2]) */
+	SFSD_WRITE,       /* fs_write(arg[0], payload, size, arg[2]) */
+	SFSD_FALLOCATE,   /* fs_fallocate(arg[0], arg[2], arg[1]) */
+	SFSD_FLUSH,       /* fs_flush(arg[0]) */
+	SFSD_SYNC,        /* fs_sync() */
+	SFSD_CLONE,       /* fs_clone(arg[0]) */
+	SFSD_SNAPSHOT,    /* fs_snapshot(reply payload, arg[1] / 8): int32 file, clone pairs */
+	SFSD_DEDUP,       /* fs_dedup(arg[0]) */
+	SFSD_DEFRAG,      /* fs_defrag(arg[0], arg[1]) */
+	SFSD_CHECK,       /* fs_check(arg[0]) */
+	SFSD_BLOCKSIZE,   /* fs_blocksize() */
+};
+
+/* arg[0] is usually the inumber, arg[1] a length and arg[2] an offset */
+struct sfsd_request {
+	uint32_t op;
+	uint32_t tag;
+	int32_t arg[3];
+	uint32_t size;
+};
+
+struct sfsd_response {
+	uint32_t tag;
+	int32_t result;
+	uint32_t size;
+};
+
+#endif